@@ -0,0 +1,141 @@
+#include "lucc.h"
+
+// Bump allocators.
+//
+// Objects living as long as a phase of the compiler are allocated from
+// that phase's arena and released together when the phase ends: the
+// tokens and the syntax tree once the IR is built, the scratch tables of
+// the optimizer once a function is optimized, the control-flow graph when
+// it is rebuilt and the text of the assembly once a function is written
+// out. An arena hands out memory from
+// the front of its current block and starts a new block when it runs
+// out; a request larger than a block gets one of its own. Blocks come
+// zeroed from calloc and are never reused, so neither is any memory.
+
+#define ARENA_BLOCK_SIZE (256 * 1024)
+#define ARENA_ALIGN 16
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+Arena tokens_arena = {"tokens"};
+Arena ast_arena = {"ast"};
+Arena ir_arena = {"ir"};
+Arena opt_arena = {"opt"};
+Arena cfg_arena = {"cfg"};
+Arena codegen_arena = {"codegen"};
+
+static Arena *arenas[] = {&tokens_arena, &ast_arena, &ir_arena,
+                          &opt_arena,    &cfg_arena, &codegen_arena};
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaBlock *b = arena->blocks;
+    if (!b || b->size - b->used < size) {
+        size_t bsize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        b = calloc(1, sizeof(ArenaBlock) + bsize);
+        if (!b)
+            error("out of memory");
+        b->size = bsize;
+        b->next = arena->blocks;
+        arena->blocks = b;
+        arena->nblocks++;
+    }
+    void *p = b->data + b->used;
+    b->used += size;
+    arena->nobjs++;
+    arena->nbytes += size;
+    arena->used += size;
+    if (arena->used > arena->peak)
+        arena->peak = arena->used;
+    return p;
+}
+
+// Grows p, which has old bytes, to size bytes. The most recent
+// allocation grows in place if its block has room; if it has a block of
+// its own, the block is resized with realloc, which need not copy.
+// Anything else is copied, and the old memory stays until the release.
+void *arena_grow(Arena *arena, void *p, size_t old, size_t size) {
+    old = (old + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (size <= old)
+        return p;
+    ArenaBlock *b = arena->blocks;
+    bool last = p && (char *)p + old == b->data + b->used;
+    if (!last || (b->size - b->used < size - old && p != b->data)) {
+        void *q = arena_alloc(arena, size);
+        if (p)
+            memcpy(q, p, old);
+        return q;
+    }
+
+    if (b->size - b->used < size - old) {
+        b = realloc(b, sizeof(ArenaBlock) + size);
+        if (!b)
+            error("out of memory");
+        // Unlike calloc, realloc leaves the new part uninitialized.
+        memset(b->data + old, 0, size - old);
+        b->size = size;
+        arena->blocks = b;
+        p = b->data;
+    }
+    b->used += size - old;
+    arena->nbytes += size - old;
+    arena->used += size - old;
+    if (arena->used > arena->peak)
+        arena->peak = arena->used;
+    return p;
+}
+
+char *arena_strndup(Arena *arena, char *s, size_t n) {
+    char *p = arena_alloc(arena, n + 1);
+    memcpy(p, s, n);
+    return p;
+}
+
+char *arena_vprintf(Arena *arena, char *fmt, va_list ap) {
+    va_list ap2;
+    va_copy(ap2, ap);
+    int len = vsnprintf(NULL, 0, fmt, ap2);
+    va_end(ap2);
+    char *buf = arena_alloc(arena, len + 1);
+    vsnprintf(buf, len + 1, fmt, ap);
+    return buf;
+}
+
+char *arena_printf(Arena *arena, char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char *buf = arena_vprintf(arena, fmt, ap);
+    va_end(ap);
+    return buf;
+}
+
+// Frees every block at once. The statistics keep counting.
+void arena_release(Arena *arena) {
+    for (ArenaBlock *b = arena->blocks, *next; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    arena->blocks = NULL;
+    arena->used = 0;
+}
+
+// Counts are over the whole run; peak is the most memory an arena had
+// handed out at once.
+void print_mem_stats(void) {
+    for (int i = 0; i < sizeof(arenas) / sizeof(*arenas); i++) {
+        Arena *a = arenas[i];
+        fprintf(stderr,
+                "arena %s: %zu objects, %zu bytes, %zu blocks, peak %zu "
+                "bytes\n",
+                a->name, a->nobjs, a->nbytes, a->nblocks, a->peak);
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(stderr, "peak RSS: %ld KiB\n", ru.ru_maxrss);
+}
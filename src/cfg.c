@@ -0,0 +1,240 @@
+#include "lucc.h"
+
+// Control-flow graph of a function.
+//
+// The IR list stays the single source of truth: a basic block records the
+// first and last IR of a maximal straight-line run of it, so build_cfg()
+// has to run again after any pass that edits the list. Besides the edges
+// it computes the dominator tree and the natural loops of the function.
+//
+// All of it lives in cfg_arena, which build_cfg() releases, so only the
+// function whose CFG was built last has one.
+
+static bool starts_block(IR *prev, IR *ir) {
+    return !prev || ir->kind == IR_LABEL || jump_target(prev) ||
+           prev->kind == IR_RETURN || prev->kind == IR_TAIL_CALL;
+}
+
+static BasicBlock *new_block(Function *fn, IR *first) {
+    BasicBlock *bb = arena_alloc(&cfg_arena, sizeof(BasicBlock));
+    bb->id = fn->nbbs++;
+    bb->first = first;
+    return bb;
+}
+
+static void add_succ(BasicBlock *from, BasicBlock *to) {
+    from->succs[from->nsuccs++] = to;
+    to->npreds++;
+}
+
+static void split_blocks(Function *fn) {
+    BasicBlock head = {};
+    BasicBlock *cur = &head;
+    fn->nbbs = 0;
+    for (IR *prev = NULL, *ir = fn->irs; ir; prev = ir, ir = ir->next) {
+        if (starts_block(prev, ir))
+            cur = cur->next = new_block(fn, ir);
+        cur->last = ir;
+    }
+    fn->bbs = head.next;
+}
+
+static void connect_blocks(Function *fn) {
+    // Label ids are allocated in order, so a table over their span maps
+    // jump targets to blocks.
+    int lo = -1, hi = -1;
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        if (bb->first->kind != IR_LABEL)
+            continue;
+        int id = bb->first->lhs->id;
+        if (lo == -1 || id < lo)
+            lo = id;
+        if (id > hi)
+            hi = id;
+    }
+    BasicBlock **labels =
+        arena_alloc(&cfg_arena, sizeof(BasicBlock *) * (hi - lo + 1));
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next)
+        if (bb->first->kind == IR_LABEL)
+            labels[bb->first->lhs->id - lo] = bb;
+
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        Operand *target = jump_target(bb->last);
+        if (target) {
+            if (target->id < lo || target->id > hi || !labels[target->id - lo])
+                error("%s: unknown label: %s", fn->name, target->name);
+            add_succ(bb, labels[target->id - lo]);
+        }
+        if (bb->next && bb->last->kind != IR_JMP &&
+            bb->last->kind != IR_RETURN && bb->last->kind != IR_TAIL_CALL)
+            add_succ(bb, bb->next);
+    }
+
+    // With the number of predecessors known, fill in the preds arrays.
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        bb->preds = arena_alloc(&cfg_arena, sizeof(BasicBlock *) * bb->npreds);
+        bb->npreds = 0;
+    }
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next)
+        for (int i = 0; i < bb->nsuccs; i++)
+            bb->succs[i]->preds[bb->succs[i]->npreds++] = bb;
+}
+
+//
+// Dominators
+//
+// The iterative algorithm by Cooper, Harvey and Kennedy, "A Simple, Fast
+// Dominance Algorithm". Unreachable blocks have no idom and rpo == -1.
+//
+
+static void visit_rpo(BasicBlock *bb, bool *seen, BasicBlock **order, int *n) {
+    seen[bb->id] = true;
+    for (int i = bb->nsuccs - 1; i >= 0; i--)
+        if (!seen[bb->succs[i]->id])
+            visit_rpo(bb->succs[i], seen, order, n);
+    order[--*n] = bb;
+}
+
+static BasicBlock *intersect(BasicBlock *a, BasicBlock *b) {
+    while (a != b) {
+        while (a->rpo > b->rpo)
+            a = a->idom;
+        while (b->rpo > a->rpo)
+            b = b->idom;
+    }
+    return a;
+}
+
+static void compute_dominators(Function *fn) {
+    bool *seen = arena_alloc(&cfg_arena, sizeof(bool) * fn->nbbs);
+    BasicBlock **order =
+        arena_alloc(&cfg_arena, sizeof(BasicBlock *) * fn->nbbs);
+    int n = fn->nbbs;
+    visit_rpo(fn->bbs, seen, order, &n);
+
+    // visit_rpo fills order from the back, skipping unreachable blocks.
+    fn->rpo = order + n;
+    fn->nrpo = fn->nbbs - n;
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next)
+        bb->rpo = -1;
+    for (int i = 0; i < fn->nrpo; i++)
+        fn->rpo[i]->rpo = i;
+
+    BasicBlock *entry = fn->bbs;
+    entry->idom = entry;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 1; i < fn->nrpo; i++) {
+            BasicBlock *bb = fn->rpo[i];
+            BasicBlock *idom = NULL;
+            for (int j = 0; j < bb->npreds; j++) {
+                BasicBlock *p = bb->preds[j];
+                if (!p->idom)
+                    continue;
+                idom = idom ? intersect(p, idom) : p;
+            }
+            if (idom != bb->idom) {
+                bb->idom = idom;
+                changed = true;
+            }
+        }
+    }
+    entry->idom = NULL;
+}
+
+bool dominates(BasicBlock *a, BasicBlock *b) {
+    if (a->rpo == -1 || b->rpo == -1)
+        return false;
+    for (; b; b = b->idom)
+        if (a == b)
+            return true;
+    return false;
+}
+
+//
+// Natural loops
+//
+// Every edge to a block dominating its source is a back edge. The loop it
+// closes consists of the header plus every block reaching the source
+// without passing the header; back edges sharing a header form one loop.
+//
+
+static Loop *find_loop(Function *fn, BasicBlock *header) {
+    for (Loop *l = fn->loops; l; l = l->next)
+        if (l->header == header)
+            return l;
+    Loop *l = arena_alloc(&cfg_arena, sizeof(Loop));
+    l->header = header;
+    l->body = arena_alloc(&cfg_arena, sizeof(bool) * fn->nbbs);
+    l->body[header->id] = true;
+    l->nblocks = 1;
+    l->next = fn->loops;
+    fn->loops = l;
+    return l;
+}
+
+static void add_to_loop(Loop *l, BasicBlock *bb) {
+    if (l->body[bb->id])
+        return;
+    l->body[bb->id] = true;
+    l->nblocks++;
+    for (int i = 0; i < bb->npreds; i++)
+        if (bb->preds[i]->rpo != -1)
+            add_to_loop(l, bb->preds[i]);
+}
+
+static void find_loops(Function *fn) {
+    fn->loops = NULL;
+    for (int i = 0; i < fn->nrpo; i++) {
+        BasicBlock *bb = fn->rpo[i];
+        for (int j = 0; j < bb->nsuccs; j++)
+            if (dominates(bb->succs[j], bb))
+                add_to_loop(find_loop(fn, bb->succs[j]), bb);
+    }
+
+    // The parent of a loop is the smallest other loop containing its
+    // header; loops are either nested or disjoint.
+    for (Loop *l = fn->loops; l; l = l->next) {
+        for (Loop *m = fn->loops; m; m = m->next)
+            if (m != l && m->body[l->header->id] &&
+                (!l->parent || m->nblocks < l->parent->nblocks))
+                l->parent = m;
+    }
+    for (Loop *l = fn->loops; l; l = l->next)
+        for (Loop *m = l; m; m = m->parent)
+            l->depth++;
+
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        for (Loop *l = fn->loops; l; l = l->next)
+            if (l->body[bb->id] && (!bb->loop || l->depth > bb->loop->depth))
+                bb->loop = l;
+        bb->loop_depth = bb->loop ? bb->loop->depth : 0;
+    }
+}
+
+void build_cfg(Function *fn) {
+    // The blocks of the function built before are gone after this.
+    static Function *last;
+    if (last && last != fn) {
+        last->bbs = NULL;
+        last->nbbs = 0;
+        last->loops = NULL;
+        last->rpo = NULL;
+        last->nrpo = 0;
+    }
+    last = fn;
+    arena_release(&cfg_arena);
+
+    fn->bbs = NULL;
+    fn->nbbs = 0;
+    fn->loops = NULL;
+    fn->rpo = NULL;
+    fn->nrpo = 0;
+    if (!fn->irs)
+        return;
+
+    split_blocks(fn);
+    connect_blocks(fn);
+    compute_dominators(fn);
+    find_loops(fn);
+}
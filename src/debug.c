@@ -6,9 +6,9 @@
         break;
 
 void print_tokens(Token *tok) {
-    for (; tok->kind != TK_EOF; tok = tok->next) {
+    for (; tok->kind != TK_EOF; tok++) {
         fprintf(stderr, " ");
-        fprintf(stderr, "%.*s", tok->len, tok->loc);
+        fprintf(stderr, "%.*s", tok->len, token_loc(tok));
     }
     fprintf(stderr, "\n");
 }
@@ -101,6 +101,8 @@ void print_opkind(OperandKind kind) {
         ENUMDUMP(OP_LABEL)
         ENUMDUMP(OP_REGISTER)
         ENUMDUMP(OP_SYMBOL)
+        ENUMDUMP(OP_ADDRESS)
+        ENUMDUMP(OP_IMM)
     }
 }
 
@@ -116,20 +118,36 @@ void print_irkind(IRKind kind) {
         ENUMDUMP(IR_IMM)
         ENUMDUMP(IR_MOV)
         ENUMDUMP(IR_LOAD)
+        ENUMDUMP(IR_PARAM)
         ENUMDUMP(IR_STORE)
         ENUMDUMP(IR_RETURN)
         ENUMDUMP(IR_JMP)
         ENUMDUMP(IR_JMPIFZERO)
+        ENUMDUMP(IR_JMPIFNONZERO)
+        ENUMDUMP(IR_BEQ)
+        ENUMDUMP(IR_BNE)
+        ENUMDUMP(IR_BLT)
+        ENUMDUMP(IR_BLE)
+        ENUMDUMP(IR_BGT)
+        ENUMDUMP(IR_BGE)
         ENUMDUMP(IR_LABEL)
-        ENUMDUMP(IR_FREE)
+        ENUMDUMP(IR_PHI)
+        ENUMDUMP(IR_CALL)
+        ENUMDUMP(IR_TAIL_CALL)
+        ENUMDUMP(IR_ADDR)
         ENUMDUMP(IR_ADD)
         ENUMDUMP(IR_SUB)
         ENUMDUMP(IR_MUL)
         ENUMDUMP(IR_DIV)
+        ENUMDUMP(IR_MULH)
+        ENUMDUMP(IR_SHL)
+        ENUMDUMP(IR_SHR)
+        ENUMDUMP(IR_SAR)
         ENUMDUMP(IR_EQ)
         ENUMDUMP(IR_NE)
         ENUMDUMP(IR_LT)
         ENUMDUMP(IR_LE)
+        ENUMDUMP(IR_SELECT)
     }
     fprintf(stderr, "(%d)", kind);
 }
@@ -147,5 +165,43 @@ void print_ir(IR *ir) {
         fprintf(stderr, ", dst: ");
         print_operand(ir->dst);
     }
+    for (int i = 0; i < ir->nphi; i++) {
+        fprintf(stderr, ", [");
+        if (ir->phi_vals[i])
+            print_operand(ir->phi_vals[i]);
+        fprintf(stderr, ", from ");
+        print_operand(ir->phi_labels[i]);
+        fprintf(stderr, "]");
+    }
     fprintf(stderr, "\n");
 }
+
+static void print_block_list(char *title, BasicBlock **bbs, int n) {
+    fprintf(stderr, ", %s:", title);
+    if (n == 0)
+        fprintf(stderr, " -");
+    for (int i = 0; i < n; i++)
+        fprintf(stderr, " bb%d", bbs[i]->id);
+}
+void print_cfg(Function *fn) {
+    fprintf(stderr, "function %s: %d blocks\n", fn->name, fn->nbbs);
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        fprintf(stderr, "bb%d", bb->id);
+        print_block_list("preds", bb->preds, bb->npreds);
+        print_block_list("succs", bb->succs, bb->nsuccs);
+        if (bb->idom)
+            fprintf(stderr, ", idom: bb%d", bb->idom->id);
+        else if (bb->rpo == -1)
+            fprintf(stderr, ", unreachable");
+        if (bb->loop)
+            fprintf(stderr, ", loop: bb%d, depth: %d", bb->loop->header->id,
+                    bb->loop_depth);
+        fprintf(stderr, "\n");
+        for (IR *ir = bb->first;; ir = ir->next) {
+            fprintf(stderr, "    ");
+            print_ir(ir);
+            if (ir == bb->last)
+                break;
+        }
+    }
+}
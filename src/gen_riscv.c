@@ -2,6 +2,14 @@
 
 static char *get_operand(Operand *op);
 static char *get_address(Operand *op);
+
+// Selected addresses never have an index here; see the rules below.
+static char *addr_base(Operand *op) {
+    return op->var ? "s0" : get_operand(op->base);
+}
+static long addr_disp(Operand *op) {
+    return op->disp + (op->var ? -op->var->offset : 0);
+}
 static char *get_operand(Operand *op) {
     switch (op->kind) {
     case OP_REGISTER:
@@ -9,12 +17,16 @@ static char *get_operand(Operand *op) {
         return op->reg->name;
     case OP_SYMBOL:
         return get_address(op);
+    case OP_IMM:
+        // The only immediate taking a register's place.
+        assert(op->val == 0);
+        return "zero";
     default:
         error("unknown operand");
     }
 }
 static char *get_address(Operand *op) {
-    char *buf = malloc(30);
+    char *buf = arena_alloc(&codegen_arena, 30);
     switch (op->kind) {
     case OP_REGISTER:
         sprintf(buf, "0(%s)", get_operand(op));
@@ -22,13 +34,16 @@ static char *get_address(Operand *op) {
     case OP_SYMBOL:
         sprintf(buf, "%d(s0)", -op->var->offset);
         return buf;
+    case OP_ADDRESS:
+        sprintf(buf, "%ld(%s)", addr_disp(op), addr_base(op));
+        return buf;
     default:
         error("not an lvalue");
     }
 }
 static char *get_label(Operand *op) {
     assert(op->kind == OP_LABEL);
-    char *buf = malloc(20 + strlen(op->name));
+    char *buf = arena_alloc(&codegen_arena, 20 + strlen(op->name));
     sprintf(buf, ".L%s%d", op->name, op->id);
     return buf;
 }
@@ -50,114 +65,232 @@ static Register *A5 = &(Register){"a5"};
 static Register *A6 = &(Register){"a6"};
 static Register *A7 = &(Register){"a7"};
 
+#define NUM_ARGREGS 8
+
+// Negated, so that subtracting can add the immediate instead.
+static bool fits_imm12(IR *ir) { return -2047 <= ir->val && ir->val < 2048; }
+static bool is_zero(IR *ir) { return ir->val == 0; }
+
+// Loads and stores take a base register plus a 12-bit displacement, which
+// addi can compute too; there are neither scaled indexes nor memory
+// operands. Only addi and slti take an immediate, but the zero register
+// stands in for the constant 0 anywhere.
+static Rule rules[] = {
+    {NT_REG, IR_IMM, {}, NULL, 1},
+    {NT_REG, IR_ADD, {NT_REG, NT_REG}, NULL, 1},
+    {NT_REG, IR_ADD, {NT_REG, NT_IMM}, NULL, 1},
+    {NT_REG, IR_SUB, {NT_REG, NT_REG}, NULL, 1},
+    {NT_REG, IR_SUB, {NT_REG, NT_IMM}, NULL, 1},
+    {NT_REG, IR_MUL, {NT_REG, NT_REG}, NULL, 3},
+    {NT_REG, IR_SHL, {NT_REG}, NULL, 1},
+    {NT_REG, IR_EQ, {NT_REG, NT_IMM}, NULL, 3},
+    {NT_REG, IR_NE, {NT_REG, NT_IMM}, NULL, 3},
+    {NT_REG, IR_LT, {NT_REG, NT_IMM}, NULL, 2},
+    {NT_REG, IR_LE, {NT_REG, NT_ZERO}, NULL, 3},
+    {NT_REG, IR_LOAD, {NT_ADDR}, is_scalar_load, 1},
+    {NT_REG, IR_LOAD, {}, is_symbol_load, 1},
+    {NT_REG, IR_LOAD, {NT_REG}, is_array_view, 1},
+    {NT_REG, CHAIN_RULE, {NT_ADDR}, NULL, 1},
+    {NT_STMT, IR_STORE, {NT_ADDR, NT_REG}, NULL, 1},
+    {NT_STMT, IR_STORE, {NT_ADDR, NT_ZERO}, NULL, 1},
+    {NT_STMT, IR_STORE, {NT_NONE, NT_ZERO}, NULL, 1},
+    {NT_STMT, IR_BEQ, {NT_REG, NT_ZERO}, NULL, 1},
+    {NT_STMT, IR_BNE, {NT_REG, NT_ZERO}, NULL, 1},
+    {NT_STMT, IR_BLT, {NT_REG, NT_ZERO}, NULL, 1},
+    {NT_STMT, IR_BLE, {NT_REG, NT_ZERO}, NULL, 1},
+    {NT_STMT, IR_BGT, {NT_REG, NT_ZERO}, NULL, 1},
+    {NT_STMT, IR_BGE, {NT_REG, NT_ZERO}, NULL, 1},
+    {NT_STMT, IR_RETURN, {NT_IMM}, NULL, 1},
+    {NT_REG, IR_SELECT, {NT_REG, NT_REG}, NULL, 4},
+    {NT_REG, IR_SELECT, {NT_REG, NT_ZERO}, NULL, 4},
+
+    {NT_IMM, IR_IMM, {}, fits_imm12, 0},
+    {NT_ZERO, IR_IMM, {}, is_zero, 0},
+    {NT_DISP, IR_IMM, {}, fits_imm12, 0},
+    {NT_BASE, CHAIN_RULE, {NT_REG}, NULL, 0},
+    {NT_BASE, IR_LOAD, {}, is_frame_addr, 0},
+    {NT_BASE, IR_ADDR, {}, is_frame_addr, 0},
+    {NT_BASE, IR_LOAD, {NT_BASE}, is_array_view, 0},
+    {NT_ADDR, CHAIN_RULE, {NT_BASE}, NULL, 0},
+    {NT_ADDR, IR_ADD, {NT_BASE, NT_DISP}, NULL, 0},
+    {NT_ADDR, IR_ADD, {NT_DISP, NT_BASE}, NULL, 0},
+    {NT_ADDR, IR_LOAD, {NT_ADDR}, is_array_view, 0},
+};
+
 static char *get_argreg(int i) {
     Register *argregs[] = {A0, A1, A2, A3, A4, A5, A6, A7};
-    if (i < 0 || i >= sizeof(argregs) / sizeof(*argregs))
+    if (i < 0 || i >= NUM_ARGREGS)
         error("argument register exhausted");
     return argregs[i]->name;
 }
-static void alloc(Operand *op) {
-    if (op->reg)
-        return;
-
-    Register *reg_riscv[] = {T0, T1, T2, T3, T4, T5, T6};
-    for (int i = 0; i < sizeof(reg_riscv) / sizeof(*reg_riscv); i++) {
-        if (reg_riscv[i]->used)
-            continue;
-        reg_riscv[i]->used = true;
-        op->reg = reg_riscv[i];
-        return;
-    }
-    error("register exhausted");
+static int count_params(Function *fn) {
+    int n = 0;
+    for (Var *v = fn->params; v; v = v->next)
+        n++;
+    return n;
 }
-static void kill(Operand *op) {
-    if (op->kind != OP_REGISTER)
-        return;
-    assert(op->reg->used);
-    op->reg->used = false;
+// The allocation pool t0-t4 is caller-saved. A call copies the registers
+// live across it to s1-s5 and back, so only those s registers need saving
+// in the prologue, and ra only if the function calls at all.
+static bool has_frame;
+static bool has_call;
+static unsigned saved_t; // bit i: t<i> is kept in s<i+1> around some call
+
+static int calc_saved(void) {
+    int n = has_call + 1;
+    for (int i = 0; i < 5; i++)
+        if (saved_t & (1u << i))
+            n++;
+    return n;
 }
+
 static void calc_stacksize(Function *func) {
-    int offset = 112;
+    has_call = false;
+    saved_t = 0;
+    for (IR *ir = func->irs; ir; ir = ir->next) {
+        if (ir->kind == IR_CALL) {
+            has_call = true;
+            saved_t |= ir->live_regs;
+        }
+    }
+
+    // The saved registers are at the top of the frame, right below s0,
+    // and the locals follow. The parameters end the list of locals, last
+    // one first. Those beyond the argument registers stay where the caller
+    // stored them, at the stack pointer on entry; promoted ones need no
+    // slot.
+    int offset = calc_saved() * 8;
+    int i = count_params(func);
+    bool param = false;
+    has_frame = has_call;
     for (Var *var = func->locals; var; var = var->next) {
-        offset += 8;
+        if (var == func->params)
+            param = true;
+        if (param && --i >= NUM_ARGREGS) {
+            var->offset = -8 * (i - NUM_ARGREGS);
+            has_frame = true;
+            continue;
+        }
+        if (var->vreg)
+            continue;
+        offset += size_of(var->ty);
         var->offset = offset;
+        has_frame = true;
     }
-    func->stacksize = align_to(offset, 16);
+
+    // Leaf functions without locals get by without a frame.
+    func->stacksize = has_frame ? align_to(offset, 16) : 0;
 }
-static void alloc_regs(IR *ir) {
-    for (; ir; ir = ir->next) {
-        switch (ir->kind) {
-        case IR_NOP:
-        case IR_LABEL:
-        case IR_JMP:
-            break;
-        case IR_JMPIFZERO:
-            alloc(ir->rhs);
-            break;
-        case IR_IMM:
-        case IR_CALL:
-            alloc(ir->dst);
-            break;
-        case IR_STORE:
-            alloc(ir->rhs);
-            ir->dst->reg = ir->rhs->reg;
-            break;
-        case IR_MOV:
-        case IR_LOAD:
-        case IR_ADDR:
-        case IR_ADD:
-        case IR_SUB:
-        case IR_MUL:
-        case IR_DIV:
-        case IR_EQ:
-        case IR_NE:
-        case IR_LT:
-        case IR_LE:
-            alloc(ir->lhs);
-            ir->dst->reg = ir->lhs->reg;
-            break;
-        case IR_RETURN:
-        case IR_STACK_ARG:
-            kill(ir->lhs);
-            break;
-        case IR_FREE:
-            kill(ir->lhs);
-            ir->kind = IR_NOP;
-            break;
-        default:
-            error("unknown IR operator");
-        }
+
+// Call arguments may still live in their spill slots; see regalloc.c.
+static void emit_arg(Operand *op, char *reg) {
+    if (op->reg)
+        emitfln("\tmv %s, %s", reg, get_operand(op));
+    else
+        emitfln("\tld %s, %d(s0)", reg, -op->var->offset);
+}
+
+// Moves the arguments of a call into the argument registers and stores
+// the rest in a new outgoing area at the stack pointer. Returns the size
+// of that area.
+static int emit_args(IR *ir) {
+    int nstack = ir->nargs > NUM_ARGREGS ? ir->nargs - NUM_ARGREGS : 0;
+    int size = align_to(nstack * 8, 16);
+    if (size)
+        emitfln("\taddi sp, sp, -%d", size);
+    for (int i = NUM_ARGREGS; i < ir->nargs; i++) {
+        emit_arg(ir->args[i], "t5");
+        emitfln("\tsd t5, %d(sp)", (i - NUM_ARGREGS) * 8);
     }
+    for (int i = 0; i < ir->nargs && i < NUM_ARGREGS; i++)
+        emit_arg(ir->args[i], get_argreg(i));
+    return size;
+}
+// Stores (insn "sd") or reloads (insn "ld") the registers the frame saves.
+static void save_regs(Function *fn, char *insn) {
+    int offset = fn->stacksize;
+    if (has_call)
+        emitfln("\t%s ra, %d(sp)", insn, offset -= 8);
+    emitfln("\t%s s0, %d(sp)", insn, offset -= 8);
+    for (int i = 0; i < 5; i++)
+        if (saved_t & (1u << i))
+            emitfln("\t%s s%d, %d(sp)", insn, i + 1, offset -= 8);
+}
+
+static void emit_prologue(Function *fn) {
+    if (!has_frame)
+        return;
+    emitfln("\taddi sp, sp, -%d", fn->stacksize);
+    save_regs(fn, "sd");
+    emitfln("\taddi s0, sp, %d", fn->stacksize);
+}
+
+// Computes lhs - rhs of a comparison for equality into dst.
+static void emit_diff(IR *ir) {
+    if (ir->rhs->kind == OP_IMM)
+        emitfln("\taddi %s, %s, %ld", get_operand(ir->dst),
+                get_operand(ir->lhs), -ir->rhs->val);
+    else
+        emitfln("\tsub %s, %s, %s", get_operand(ir->dst),
+                get_operand(ir->lhs), get_operand(ir->rhs));
+}
+
+// Selects with Zicond: czero.eqz rd, rs, c clears rd if c is zero and
+// copies rs otherwise, czero.nez does the opposite. The condition goes to
+// a6 as a value that is zero or not, and a7 holds the masked first choice,
+// so that dst, which may share a register with any operand, is written
+// last.
+static void emit_select(IR *ir) {
+    char *lhs = get_operand(ir->lhs), *rhs = get_operand(ir->rhs);
+    bool if_zero = false; // whether the condition holds when a6 is zero
+    switch (ir->val) {
+    case IR_BEQ:
+    case IR_BNE:
+        emitfln("\tsub a6, %s, %s", lhs, rhs);
+        if_zero = ir->val == IR_BEQ;
+        break;
+    case IR_BLT:
+    case IR_BGE:
+        emitfln("\tslt a6, %s, %s", lhs, rhs);
+        if_zero = ir->val == IR_BGE;
+        break;
+    case IR_BGT:
+    case IR_BLE:
+        emitfln("\tslt a6, %s, %s", rhs, lhs);
+        if_zero = ir->val == IR_BLE;
+        break;
+    }
+    emitfln("\t%s a7, %s, a6", if_zero ? "czero.nez" : "czero.eqz",
+            get_operand(ir->args[0]));
+    emitfln("\t%s a6, %s, a6", if_zero ? "czero.eqz" : "czero.nez",
+            get_operand(ir->args[1]));
+    emitfln("\tor %s, a6, a7", get_operand(ir->dst));
+}
+
+// Restores the callee-saved registers and pops the frame.
+static void emit_epilogue(Function *fn) {
+    if (!has_frame)
+        return;
+    save_regs(fn, "ld");
+    emitfln("\taddi sp, sp, %d", fn->stacksize);
 }
 
 static void codegen_fn(Function *fn) {
+    Register *regs[] = {T0, T1, T2, T3, T4};
+    // A select reads four registers; the a registers only carry values
+    // within calls and on entry, and a6 and a7 are its temporaries.
+    Register *scratch[] = {T5, T6, A4, A5};
+    select_instructions(fn, rules, sizeof(rules) / sizeof(*rules));
+    alloc_regs(fn, regs, sizeof(regs) / sizeof(*regs), scratch);
     calc_stacksize(fn);
-    alloc_regs(fn->irs);
 
     emitfln(".globl %s", fn->name);
     emitfln("%s:", fn->name);
-    emitfln("\taddi sp, sp, -%d", fn->stacksize);
-    emitfln("\tsd ra, %d(sp)", fn->stacksize - 8);
-    emitfln("\tsd s0, %d(sp)", fn->stacksize - 16);
-    emitfln("\tsd s1, %d(sp)", fn->stacksize - 24);
-    emitfln("\tsd s2, %d(sp)", fn->stacksize - 32);
-    emitfln("\tsd s3, %d(sp)", fn->stacksize - 40);
-    emitfln("\tsd s4, %d(sp)", fn->stacksize - 48);
-    emitfln("\tsd s5, %d(sp)", fn->stacksize - 56);
-    emitfln("\tsd s6, %d(sp)", fn->stacksize - 64);
-    emitfln("\tsd s7, %d(sp)", fn->stacksize - 72);
-    emitfln("\tsd s8, %d(sp)", fn->stacksize - 80);
-    emitfln("\tsd s9, %d(sp)", fn->stacksize - 88);
-    emitfln("\tsd s10, %d(sp)", fn->stacksize - 96);
-    emitfln("\tsd s11, %d(sp)", fn->stacksize - 104);
-    emitfln("\taddi s0, sp, %d", fn->stacksize);
-    // TODO: save callee-saved registers
-    int i = 0;
-    for (Var *v = fn->params; v; v = v->next) {
-        i++;
-    }
+    emit_prologue(fn);
+    int i = count_params(fn);
     for (Var *v = fn->params; v; v = v->next) {
-        emitfln("\tsd %s, -%d(s0)", get_argreg(--i), v->offset);
+        if (--i < NUM_ARGREGS && !v->vreg)
+            emitfln("\tsd %s, -%d(s0)", get_argreg(i), v->offset);
     }
 
     for (IR *ir = fn->irs; ir; ir = ir->next) {
@@ -170,15 +303,48 @@ static void codegen_fn(Function *fn) {
         case IR_JMPIFZERO:
             emitfln("\tbeqz %s, %s", get_operand(ir->rhs), get_label(ir->lhs));
             break;
+        case IR_JMPIFNONZERO:
+            emitfln("\tbnez %s, %s", get_operand(ir->rhs), get_label(ir->lhs));
+            break;
+        case IR_BEQ:
+            emitfln("\tbeq %s, %s, %s", get_operand(ir->lhs),
+                    get_operand(ir->rhs), get_label(ir->dst));
+            break;
+        case IR_BNE:
+            emitfln("\tbne %s, %s, %s", get_operand(ir->lhs),
+                    get_operand(ir->rhs), get_label(ir->dst));
+            break;
+        case IR_BLT:
+            emitfln("\tblt %s, %s, %s", get_operand(ir->lhs),
+                    get_operand(ir->rhs), get_label(ir->dst));
+            break;
+        case IR_BLE:
+            emitfln("\tbge %s, %s, %s", get_operand(ir->rhs),
+                    get_operand(ir->lhs), get_label(ir->dst));
+            break;
+        case IR_BGT:
+            emitfln("\tblt %s, %s, %s", get_operand(ir->rhs),
+                    get_operand(ir->lhs), get_label(ir->dst));
+            break;
+        case IR_BGE:
+            emitfln("\tbge %s, %s, %s", get_operand(ir->lhs),
+                    get_operand(ir->rhs), get_label(ir->dst));
+            break;
         case IR_LABEL:
+            if (ir->val)
+                emitfln("\t.p2align %ld", ir->val);
             emitfln("%s:", get_label(ir->lhs));
             break;
         case IR_IMM:
             emitfln("\tli %s, %lu", get_operand(ir->dst), ir->val);
             break;
         case IR_ADDR:
-            emitfln("\taddi %s, s0, %d", get_operand(ir->dst),
-                    -ir->lhs->var->offset);
+            if (ir->lhs->kind == OP_ADDRESS)
+                emitfln("\taddi %s, %s, %ld", get_operand(ir->dst),
+                        addr_base(ir->lhs), addr_disp(ir->lhs));
+            else
+                emitfln("\taddi %s, s0, %d", get_operand(ir->dst),
+                        -ir->lhs->var->offset);
             break;
         case IR_LOAD:
             if (ir->dst->ty->kind == TY_ARRAY) {
@@ -194,34 +360,54 @@ static void codegen_fn(Function *fn) {
                         get_address(ir->lhs));
             }
             break;
+        case IR_PARAM:
+            if (ir->val < NUM_ARGREGS)
+                emitfln("\tmv %s, %s", get_operand(ir->dst),
+                        get_argreg(ir->val));
+            else
+                emitfln("\tld %s, %ld(s0)", get_operand(ir->dst),
+                        8 * (ir->val - NUM_ARGREGS));
+            break;
         case IR_STORE:
-            emitfln("\tsd %s, %s", get_operand(ir->dst), get_address(ir->lhs));
+            emitfln("\tsd %s, %s", get_operand(ir->rhs), get_address(ir->lhs));
             break;
         case IR_MOV:
-            emitfln("\tmv %s, %s", get_operand(ir->dst), get_operand(ir->rhs));
+            emitfln("\tmv %s, %s", get_operand(ir->dst), get_operand(ir->lhs));
             break;
-        case IR_CALL:
-            for (int i = 0; i < 7; i++)
-                emitfln("\tmv s%d, t%d", i + 1, i);
-
-            for (int i = 0; i < ir->nargs; i++) {
-                emitfln("\tld %s, %d(s0)", get_argreg(i), -ir->args[i]->offset);
-            }
+        case IR_CALL: {
+            for (int i = 0; i < 5; i++)
+                if (ir->live_regs & (1u << i))
+                    emitfln("\tmv s%d, t%d", i + 1, i);
+            int size = emit_args(ir);
             emitfln("\tcall %s", ir->funcname);
-            for (int i = 0; i < 7; i++)
-                emitfln("\tmv t%d, s%d", i, i + 1);
+            if (size)
+                emitfln("\taddi sp, sp, %d", size);
+            for (int i = 0; i < 5; i++)
+                if (ir->live_regs & (1u << i))
+                    emitfln("\tmv t%d, s%d", i, i + 1);
             emitfln("\tmv %s, a0", get_operand(ir->dst));
             break;
-        case IR_STACK_ARG:
-            emitfln("\tsd %s, %s", get_operand(ir->lhs), get_address(ir->dst));
+        }
+        case IR_TAIL_CALL:
+            emit_args(ir);
+            emit_epilogue(fn);
+            emitfln("\ttail %s", ir->funcname);
             break;
         case IR_ADD:
-            emitfln("\tadd %s, %s, %s", get_operand(ir->dst),
-                    get_operand(ir->lhs), get_operand(ir->rhs));
+            if (ir->rhs->kind == OP_IMM)
+                emitfln("\taddi %s, %s, %ld", get_operand(ir->dst),
+                        get_operand(ir->lhs), ir->rhs->val);
+            else
+                emitfln("\tadd %s, %s, %s", get_operand(ir->dst),
+                        get_operand(ir->lhs), get_operand(ir->rhs));
             break;
         case IR_SUB:
-            emitfln("\tsub %s, %s, %s", get_operand(ir->dst),
-                    get_operand(ir->lhs), get_operand(ir->rhs));
+            if (ir->rhs->kind == OP_IMM)
+                emitfln("\taddi %s, %s, %ld", get_operand(ir->dst),
+                        get_operand(ir->lhs), -ir->rhs->val);
+            else
+                emitfln("\tsub %s, %s, %s", get_operand(ir->dst),
+                        get_operand(ir->lhs), get_operand(ir->rhs));
             break;
         case IR_MUL:
             emitfln("\tmul %s, %s, %s", get_operand(ir->dst),
@@ -231,25 +417,43 @@ static void codegen_fn(Function *fn) {
             emitfln("\tdiv %s, %s, %s", get_operand(ir->dst),
                     get_operand(ir->lhs), get_operand(ir->rhs));
             break;
-        case IR_EQ:
-            emitfln("\tsub %s, %s, %s", get_operand(ir->dst),
+        case IR_MULH:
+            emitfln("\tmulh %s, %s, %s", get_operand(ir->dst),
                     get_operand(ir->lhs), get_operand(ir->rhs));
+            break;
+        case IR_SHL:
+            emitfln("\tslli %s, %s, %ld", get_operand(ir->dst),
+                    get_operand(ir->lhs), ir->val);
+            break;
+        case IR_SHR:
+            emitfln("\tsrli %s, %s, %ld", get_operand(ir->dst),
+                    get_operand(ir->lhs), ir->val);
+            break;
+        case IR_SAR:
+            emitfln("\tsrai %s, %s, %ld", get_operand(ir->dst),
+                    get_operand(ir->lhs), ir->val);
+            break;
+        case IR_EQ:
+            emit_diff(ir);
             emitfln("\tseqz %s, %s", get_operand(ir->dst),
                     get_operand(ir->dst));
             emitfln("\tandi %s, %s, 0xff", get_operand(ir->dst),
                     get_operand(ir->dst));
             break;
         case IR_NE:
-            emitfln("\tsub %s, %s, %s", get_operand(ir->dst),
-                    get_operand(ir->lhs), get_operand(ir->rhs));
+            emit_diff(ir);
             emitfln("\tsnez %s, %s", get_operand(ir->dst),
                     get_operand(ir->dst));
             emitfln("\tandi %s, %s, 0xff", get_operand(ir->dst),
                     get_operand(ir->dst));
             break;
         case IR_LT:
-            emitfln("\tslt %s, %s, %s", get_operand(ir->dst),
-                    get_operand(ir->lhs), get_operand(ir->rhs));
+            if (ir->rhs->kind == OP_IMM)
+                emitfln("\tslti %s, %s, %ld", get_operand(ir->dst),
+                        get_operand(ir->lhs), ir->rhs->val);
+            else
+                emitfln("\tslt %s, %s, %s", get_operand(ir->dst),
+                        get_operand(ir->lhs), get_operand(ir->rhs));
             emitfln("\tandi %s, %s, 0xff", get_operand(ir->dst),
                     get_operand(ir->dst));
             break;
@@ -261,34 +465,44 @@ static void codegen_fn(Function *fn) {
             emitfln("\tandi %s, %s, 0xff", get_operand(ir->dst),
                     get_operand(ir->dst));
             break;
+        case IR_SELECT:
+            emit_select(ir);
+            break;
         case IR_RETURN:
-            emitfln("\tmv a0, %s", get_operand(ir->lhs));
-            emitfln("\tj .L.return.%s", fn->name);
+            if (ir->lhs->kind == OP_IMM)
+                emitfln("\tli a0, %ld", ir->lhs->val);
+            else
+                emitfln("\tmv a0, %s", get_operand(ir->lhs));
+            if (ir->next)
+                emitfln("\tj .L.return.%s", fn->name);
             break;
         default:
             error("unknown IR operator");
         }
     }
     emitfln(".L.return.%s:", fn->name);
-    emitfln("\tld ra, %d(sp)", fn->stacksize - 8);
-    emitfln("\tld s0, %d(sp)", fn->stacksize - 16);
-    emitfln("\tld s1, %d(sp)", fn->stacksize - 24);
-    emitfln("\tld s2, %d(sp)", fn->stacksize - 32);
-    emitfln("\tld s3, %d(sp)", fn->stacksize - 40);
-    emitfln("\tld s4, %d(sp)", fn->stacksize - 48);
-    emitfln("\tld s5, %d(sp)", fn->stacksize - 56);
-    emitfln("\tld s6, %d(sp)", fn->stacksize - 64);
-    emitfln("\tld s7, %d(sp)", fn->stacksize - 72);
-    emitfln("\tld s8, %d(sp)", fn->stacksize - 80);
-    emitfln("\tld s9, %d(sp)", fn->stacksize - 88);
-    emitfln("\tld s10, %d(sp)", fn->stacksize - 96);
-    emitfln("\tld s11, %d(sp)", fn->stacksize - 104);
-    emitfln("\taddi sp, sp, %d", fn->stacksize);
+    emit_epilogue(fn);
     emitfln("\tjr ra");
 }
 
+
+// Moves the allocator left behind and reloads of a value just spilled.
+static PeepRule peep_rules[] = {
+    {"self-move", {"mv R, R"}, {}},
+    {"move-back", {"mv R, S", "mv S, R"}, {"mv R, S"}},
+    {"reload", {"sd R, M", "ld R, M"}, {"sd R, M"}},
+    {"reload-copy", {"sd R, M", "ld S, M"}, {"sd R, M", "mv S, R"}},
+    {"add-zero", {"addi R, R, 0"}, {}},
+    {"jump-to-next", {"j L", "L:"}, {"L:"}},
+};
+
 void codegen_riscv(Program *prog) {
+    int nrules = sizeof(peep_rules) / sizeof(*peep_rules);
     for (Function *fn = prog->fns; fn; fn = fn->next) {
         codegen_fn(fn);
+        peephole(peep_rules, nrules);
+        flush_insts();
     }
+    if (opt_stats)
+        print_peephole_stats(peep_rules, nrules);
 }
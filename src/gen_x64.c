@@ -1,5 +1,6 @@
 #include "lucc.h"
 
+static Register *RAX = &(Register){"%rax"};
 static Register *RBX = &(Register){"%rbx"};
 static Register *R10 = &(Register){"%r10"};
 static Register *R11 = &(Register){"%r11"};
@@ -15,6 +16,15 @@ static Register *RDX = &(Register){"%rdx"};
 static Register *R8 = &(Register){"%r8"};
 static Register *R9 = &(Register){"%r9"};
 
+// The allocation pool. All of it is callee-saved, so values survive calls
+// and only the registers a function assigns need saving in its prologue.
+#define NUM_POOL 5
+
+static Register *get_poolreg(int i) {
+    Register *pool[] = {RBX, R12, R13, R14, R15};
+    return pool[i];
+}
+
 static char *get_address(Operand *op);
 static char *get_operand(Operand *op) {
     switch (op->kind) {
@@ -22,24 +32,32 @@ static char *get_operand(Operand *op) {
         assert(op->reg);
         return op->reg->name;
     case OP_LABEL: {
-        char *buf = malloc(20 + strlen(op->name));
+        char *buf = arena_alloc(&codegen_arena, 20 + strlen(op->name));
         sprintf(buf, ".L%s%d", op->name, op->id);
         return buf;
     }
     case OP_SYMBOL:
+    case OP_ADDRESS:
         return get_address(op);
+    case OP_IMM: {
+        char *buf = arena_alloc(&codegen_arena, 30);
+        sprintf(buf, "$%ld", op->val);
+        return buf;
+    }
     }
 }
 
+#define NUM_ARGREGS 6
+
 static char *get_argreg(int i) {
-    Register *argregs[] = {RDI, RSI, RCX, RDX, R8, R9};
-    if (i < 0 || i >= sizeof(argregs) / sizeof(*argregs))
+    Register *argregs[] = {RDI, RSI, RDX, RCX, R8, R9};
+    if (i < 0 || i >= NUM_ARGREGS)
         error("argument register exhausted");
     return argregs[i]->name;
 }
 
 static char *get_address(Operand *op) {
-    char *buf = malloc(30);
+    char *buf = arena_alloc(&codegen_arena, 50);
     switch (op->kind) {
     case OP_REGISTER: {
         sprintf(buf, "(%s)", get_operand(op));
@@ -49,90 +67,228 @@ static char *get_address(Operand *op) {
         sprintf(buf, "%d(%%rbp)", -op->var->offset);
         return buf;
     }
+    case OP_ADDRESS: {
+        long disp = op->disp + (op->var ? -op->var->offset : 0);
+        char *base = op->var ? "%rbp" : op->base->reg->name;
+        int n = disp ? sprintf(buf, "%ld", disp) : 0;
+        if (op->index)
+            sprintf(buf + n, "(%s,%s,%d)", base, op->index->reg->name,
+                    op->scale);
+        else
+            sprintf(buf + n, "(%s)", base);
+        return buf;
+    }
     default:
         error("not an lvalue");
     }
 }
 
-static void alloc(Operand *op) {
+static bool fits_imm32(IR *ir) { return ir->val == (int)ir->val; }
+static bool fits_scale(IR *ir) { return ir->val <= 3; }
+
+// Memory operands and 32-bit immediates are as cheap as registers for ALU
+// instructions and compares, and lea computes any
+// base + index * 1/2/4/8 + disp32 in one instruction.
+static Rule rules[] = {
+    {NT_REG, IR_IMM, {}, NULL, 1},
+    {NT_REG, IR_ADD, {NT_REG, NT_REG}, NULL, 1},
+    {NT_REG, IR_ADD, {NT_REG, NT_MEM}, NULL, 1},
+    {NT_REG, IR_ADD, {NT_REG, NT_IMM}, NULL, 1},
+    {NT_REG, IR_SUB, {NT_REG, NT_REG}, NULL, 1},
+    {NT_REG, IR_SUB, {NT_REG, NT_MEM}, NULL, 1},
+    {NT_REG, IR_SUB, {NT_REG, NT_IMM}, NULL, 1},
+    {NT_REG, IR_MUL, {NT_REG, NT_REG}, NULL, 3},
+    {NT_REG, IR_MUL, {NT_REG, NT_MEM}, NULL, 3},
+    {NT_REG, IR_MUL, {NT_REG, NT_IMM}, NULL, 3},
+    {NT_REG, IR_SHL, {NT_REG}, NULL, 1},
+    {NT_REG, IR_EQ, {NT_REG, NT_IMM}, NULL, 3},
+    {NT_REG, IR_NE, {NT_REG, NT_IMM}, NULL, 3},
+    {NT_REG, IR_LT, {NT_REG, NT_IMM}, NULL, 3},
+    {NT_REG, IR_LE, {NT_REG, NT_IMM}, NULL, 3},
+    {NT_REG, IR_LOAD, {NT_ADDR}, is_scalar_load, 1},
+    {NT_REG, IR_LOAD, {}, is_symbol_load, 1},
+    {NT_REG, IR_LOAD, {NT_REG}, is_array_view, 1},
+    {NT_REG, CHAIN_RULE, {NT_ADDR}, NULL, 1},
+    {NT_STMT, IR_STORE, {NT_ADDR, NT_REG}, NULL, 1},
+    {NT_STMT, IR_STORE, {NT_ADDR, NT_IMM}, NULL, 1},
+    {NT_STMT, IR_STORE, {NT_NONE, NT_IMM}, NULL, 1},
+    {NT_STMT, IR_BEQ, {NT_REG, NT_IMM}, NULL, 2},
+    {NT_STMT, IR_BNE, {NT_REG, NT_IMM}, NULL, 2},
+    {NT_STMT, IR_BLT, {NT_REG, NT_IMM}, NULL, 2},
+    {NT_STMT, IR_BLE, {NT_REG, NT_IMM}, NULL, 2},
+    {NT_STMT, IR_BGT, {NT_REG, NT_IMM}, NULL, 2},
+    {NT_STMT, IR_BGE, {NT_REG, NT_IMM}, NULL, 2},
+    {NT_STMT, IR_RETURN, {NT_IMM}, NULL, 1},
+    {NT_REG, IR_SELECT, {NT_REG, NT_REG}, NULL, 3},
+    {NT_REG, IR_SELECT, {NT_REG, NT_IMM}, NULL, 3},
+
+    {NT_IMM, IR_IMM, {}, fits_imm32, 0},
+    {NT_DISP, IR_IMM, {}, fits_imm32, 0},
+    {NT_BASE, CHAIN_RULE, {NT_REG}, NULL, 0},
+    {NT_BASE, IR_LOAD, {}, is_frame_addr, 0},
+    {NT_BASE, IR_ADDR, {}, is_frame_addr, 0},
+    {NT_BASE, IR_LOAD, {NT_BASE}, is_array_view, 0},
+    {NT_INDEX, CHAIN_RULE, {NT_REG}, NULL, 0},
+    {NT_INDEX, IR_SHL, {NT_REG}, fits_scale, 0},
+    {NT_BI, CHAIN_RULE, {NT_BASE}, NULL, 0},
+    {NT_BI, IR_ADD, {NT_BASE, NT_INDEX}, NULL, 0},
+    {NT_BI, IR_ADD, {NT_INDEX, NT_BASE}, NULL, 0},
+    {NT_BI, IR_LOAD, {NT_BI}, is_array_view, 0},
+    {NT_ADDR, CHAIN_RULE, {NT_BI}, NULL, 0},
+    {NT_ADDR, IR_ADD, {NT_BI, NT_DISP}, NULL, 0},
+    {NT_ADDR, IR_ADD, {NT_DISP, NT_BI}, NULL, 0},
+    {NT_ADDR, IR_LOAD, {NT_ADDR}, is_array_view, 0},
+    {NT_MEM, IR_LOAD, {NT_ADDR}, is_scalar_load, 0},
+    {NT_MEM, IR_LOAD, {}, is_symbol_load, 0},
+};
+
+// Call arguments may still live in their spill slots; see regalloc.c.
+static char *get_arg(Operand *op) {
     if (op->reg)
-        return;
+        return get_operand(op);
+    char *buf = arena_alloc(&codegen_arena, 30);
+    sprintf(buf, "%d(%%rbp)", -op->var->offset);
+    return buf;
+}
 
-    Register *reg_x64[] = {RBX, R10, R11, R12, R13, R14, R15};
-    for (int i = 0; i < sizeof(reg_x64) / sizeof(*reg_x64); i++) {
-        if (reg_x64[i]->used)
-            continue;
-        reg_x64[i]->used = true;
-        op->reg = reg_x64[i];
-        return;
+// Copies src into dst unless the allocator already put them together.
+static void emit_mov(Operand *src, Operand *dst) {
+    if (src->reg != dst->reg)
+        emitfln("\tmov %s, %s", get_operand(src), get_operand(dst));
+}
+
+// Returns the condition code of a branch kind, or of its negation.
+static char *cond_code(int kind, bool negate) {
+    switch (kind) {
+    case IR_BEQ:
+        return negate ? "ne" : "e";
+    case IR_BNE:
+        return negate ? "e" : "ne";
+    case IR_BLT:
+        return negate ? "ge" : "l";
+    case IR_BLE:
+        return negate ? "g" : "le";
+    case IR_BGT:
+        return negate ? "le" : "g";
+    case IR_BGE:
+        return negate ? "l" : "ge";
     }
-    error("register exhausted");
+    error("not a branch: %d", kind);
 }
-static void kill(Operand *op) {
-    if (op->kind != OP_REGISTER)
+
+// The compare goes first, as dst may share a register with any operand
+// and moves leave the flags alone.
+static void emit_select(IR *ir) {
+    Operand *t = ir->args[0], *f = ir->args[1];
+    emitfln("\tcmp %s, %s", get_operand(ir->rhs), get_operand(ir->lhs));
+    if (t->reg == ir->dst->reg) {
+        emitfln("\tcmov%s %s, %s", cond_code(ir->val, true), get_operand(f),
+                get_operand(ir->dst));
         return;
-    assert(op->reg->used);
-    op->reg->used = false;
+    }
+    emit_mov(f, ir->dst);
+    emitfln("\tcmov%s %s, %s", cond_code(ir->val, false), get_operand(t),
+            get_operand(ir->dst));
+}
+
+static int count_params(Function *fn) {
+    int n = 0;
+    for (Var *v = fn->params; v; v = v->next)
+        n++;
+    return n;
 }
 
+// whether the current function sets up %rbp
+static bool has_frame;
+static int nsaved;
+
 static void calc_stacksize(Function *func) {
-    int offset = 32;
+    nsaved = 0;
+    for (int i = 0; i < NUM_POOL; i++)
+        if (func->used_regs & (1u << i))
+            nsaved++;
+
+    // The saved registers are pushed right below %rbp and the locals
+    // follow. The parameters end the list of locals, last one first.
+    // Those beyond the argument registers stay where the caller pushed
+    // them, above the return address; promoted ones need no slot.
+    int offset = nsaved * 8;
+    int i = count_params(func);
+    bool param = false;
+    has_frame = false;
     for (Var *var = func->locals; var; var = var->next) {
+        if (var == func->params)
+            param = true;
+        if (param && --i >= NUM_ARGREGS) {
+            var->offset = -(16 + 8 * (i - NUM_ARGREGS));
+            has_frame = true;
+            continue;
+        }
+        if (var->vreg)
+            continue;
         offset += size_of(var->ty);
         var->offset = offset;
     }
-    func->stacksize = align_to(offset, 16);
+
+    // Leaf functions without locals get by without a frame. Tail calls
+    // leave with the stack as it was on entry, so they are fine too.
+    for (IR *ir = func->irs; ir; ir = ir->next)
+        if (ir->kind == IR_CALL)
+            has_frame = true;
+    if (offset > nsaved * 8)
+        has_frame = true;
+    func->stacksize = has_frame ? align_to(offset, 16) : offset;
 }
 
-static void alloc_regs(IR *ir) {
-    for (; ir; ir = ir->next) {
-        switch (ir->kind) {
-        case IR_NOP:
-        case IR_LABEL:
-        case IR_JMP:
-            break;
-        case IR_JMPIFZERO:
-            alloc(ir->rhs);
-            break;
-        case IR_IMM:
-        case IR_CALL:
-            alloc(ir->dst);
-            break;
-        case IR_STORE:
-            alloc(ir->rhs);
-            ir->dst->reg = ir->rhs->reg;
-            break;
-        case IR_MOV:
-        case IR_LOAD:
-        case IR_ADDR:
-        case IR_ADD:
-        case IR_SUB:
-        case IR_MUL:
-        case IR_DIV:
-        case IR_EQ:
-        case IR_NE:
-        case IR_LT:
-        case IR_LE:
-            alloc(ir->lhs);
-            ir->dst->reg = ir->lhs->reg;
-            break;
-        case IR_RETURN:
-        case IR_STACK_ARG:
-            kill(ir->lhs);
-            break;
-        case IR_FREE:
-            kill(ir->lhs);
-            ir->kind = IR_NOP;
-            break;
-        default:
-            error("unknown IR operator");
-        }
+// Moves the arguments of a call into the argument registers and pushes
+// the rest right to left, keeping the stack 16-byte aligned. Returns the
+// number of bytes pushed.
+static int emit_args(IR *ir) {
+    int nstack = ir->nargs > NUM_ARGREGS ? ir->nargs - NUM_ARGREGS : 0;
+    int pad = (nstack % 2) * 8;
+    if (pad)
+        emitfln("\tsub $%d, %%rsp", pad);
+    for (int i = ir->nargs - 1; i >= NUM_ARGREGS; i--)
+        emitfln("\tpushq %s", get_arg(ir->args[i]));
+    for (int i = 0; i < ir->nargs && i < NUM_ARGREGS; i++)
+        emitfln("\tmov %s, %s", get_arg(ir->args[i]), get_argreg(i));
+    return nstack * 8 + pad;
+}
+
+static void emit_prologue(Function *fn) {
+    if (has_frame) {
+        emitfln("\tpush %%rbp");
+        emitfln("\tmov %%rsp, %%rbp");
     }
+    for (int i = 0; i < NUM_POOL; i++)
+        if (fn->used_regs & (1u << i))
+            emitfln("\tpush %s", get_poolreg(i)->name);
+    if (fn->stacksize > nsaved * 8)
+        emitfln("\tsub $%d, %%rsp", fn->stacksize - nsaved * 8);
+}
+
+// Restores the callee-saved registers and pops the frame.
+static void emit_epilogue(Function *fn) {
+    if (fn->stacksize > nsaved * 8)
+        emitfln("\tlea -%d(%%rbp), %%rsp", nsaved * 8);
+    for (int i = NUM_POOL - 1; i >= 0; i--)
+        if (fn->used_regs & (1u << i))
+            emitfln("\tpop %s", get_poolreg(i)->name);
+    if (has_frame)
+        emitfln("\tpop %%rbp");
 }
 
 static void codegen_fn(Function *fn) {
+    Register *regs[NUM_POOL];
+    for (int i = 0; i < NUM_POOL; i++)
+        regs[i] = get_poolreg(i);
+    // An instruction reads up to three registers when one of its operands
+    // is an address, and a select four. None of those touches %rax, and
+    // only the instructions reading two use %rdx.
+    Register *scratch[] = {R10, R11, RAX, RDX};
+    select_instructions(fn, rules, sizeof(rules) / sizeof(*rules));
+    alloc_regs(fn, regs, NUM_POOL, scratch);
     calc_stacksize(fn);
-    alloc_regs(fn->irs);
 
     if (opt_dump_ir2) {
         fprintf(stderr, "dump ir 2\n");
@@ -143,20 +299,12 @@ static void codegen_fn(Function *fn) {
 
     emitfln(".globl %s", fn->name);
     emitfln("%s:", fn->name);
-    emitfln("\tpush %%rbp");
-    emitfln("\tmov %%rsp, %%rbp");
-    emitfln("\tsub $%d, %%rsp", fn->stacksize);
-    emitfln("\tmov %%r12, -8(%%rbp)");
-    emitfln("\tmov %%r13, -16(%%rbp)");
-    emitfln("\tmov %%r14, -24(%%rbp)");
-    emitfln("\tmov %%r15, -32(%%rbp)");
+    emit_prologue(fn);
 
-    int i = 0;
-    for (Var *v = fn->params; v; v = v->next) {
-        i++;
-    }
+    int i = count_params(fn);
     for (Var *v = fn->params; v; v = v->next) {
-        emitfln("\tmov %s, -%d(%%rbp)", get_argreg(--i), v->offset);
+        if (--i < NUM_ARGREGS && !v->vreg)
+            emitfln("\tmov %s, -%d(%%rbp)", get_argreg(i), v->offset);
     }
 
     for (IR *ir = fn->irs; ir; ir = ir->next) {
@@ -172,8 +320,38 @@ static void codegen_fn(Function *fn) {
             emitfln("\tcmp $0, %s", get_operand(ir->rhs));
             emitfln("\tje %s", get_operand(ir->lhs));
             break;
+        case IR_JMPIFNONZERO:
+            emitfln("\tcmp $0, %s", get_operand(ir->rhs));
+            emitfln("\tjne %s", get_operand(ir->lhs));
+            break;
+        case IR_BEQ:
+            emitfln("\tcmp %s, %s", get_operand(ir->rhs), get_operand(ir->lhs));
+            emitfln("\tje %s", get_operand(ir->dst));
+            break;
+        case IR_BNE:
+            emitfln("\tcmp %s, %s", get_operand(ir->rhs), get_operand(ir->lhs));
+            emitfln("\tjne %s", get_operand(ir->dst));
+            break;
+        case IR_BLT:
+            emitfln("\tcmp %s, %s", get_operand(ir->rhs), get_operand(ir->lhs));
+            emitfln("\tjl %s", get_operand(ir->dst));
+            break;
+        case IR_BLE:
+            emitfln("\tcmp %s, %s", get_operand(ir->rhs), get_operand(ir->lhs));
+            emitfln("\tjle %s", get_operand(ir->dst));
+            break;
+        case IR_BGT:
+            emitfln("\tcmp %s, %s", get_operand(ir->rhs), get_operand(ir->lhs));
+            emitfln("\tjg %s", get_operand(ir->dst));
+            break;
+        case IR_BGE:
+            emitfln("\tcmp %s, %s", get_operand(ir->rhs), get_operand(ir->lhs));
+            emitfln("\tjge %s", get_operand(ir->dst));
+            break;
         case IR_LABEL:
             assert(ir->lhs->kind == OP_LABEL);
+            if (ir->val)
+                emitfln("\t.p2align %ld", ir->val);
             emitfln("%s:", get_operand(ir->lhs));
             break;
         case IR_IMM:
@@ -191,39 +369,47 @@ static void codegen_fn(Function *fn) {
                         get_operand(ir->dst));
             }
             break;
+        case IR_PARAM:
+            if (ir->val < NUM_ARGREGS)
+                emitfln("\tmov %s, %s", get_argreg(ir->val),
+                        get_operand(ir->dst));
+            else
+                emitfln("\tmov %ld(%%rbp), %s",
+                        16 + 8 * (ir->val - NUM_ARGREGS), get_operand(ir->dst));
+            break;
         case IR_STORE:
-            emitfln("\tmov %s, %s", get_operand(ir->rhs), get_address(ir->lhs));
+            // Without a register operand the size needs a suffix.
+            emitfln("\tmov%s %s, %s", ir->rhs->kind == OP_IMM ? "q" : "",
+                    get_operand(ir->rhs), get_address(ir->lhs));
             break;
         case IR_MOV:
-            emitfln("\tmov %s, %s", get_operand(ir->rhs), get_operand(ir->dst));
-            break;
-        case IR_CALL:
-            emitfln("sub $32, %%rsp");
-            emitfln("mov %%rbx, 8(%%rsp)");
-            emitfln("mov %%r10, 16(%%rsp)");
-            emitfln("mov %%r11, 24(%%rsp)");
-            for (int i = 0; i < ir->nargs; i++) {
-                emitfln("\tmov %d(%%rbp), %s", -ir->args[i]->offset,
-                        get_argreg(i));
-            }
+            emit_mov(ir->lhs, ir->dst);
+            break;
+        case IR_CALL: {
+            int pushed = emit_args(ir);
             emitfln("\tmov $0, %%rax");
             emitfln("\tcall %s", ir->funcname);
-            emitfln("mov 8(%%rsp), %%rbx");
-            emitfln("mov 16(%%rsp), %%r10");
-            emitfln("mov 24(%%rsp), %%r11");
-            emitfln("add $32, %%rsp");
+            if (pushed)
+                emitfln("\tadd $%d, %%rsp", pushed);
             emitfln("\tmov %%rax, %s", get_operand(ir->dst));
             break;
-        case IR_STACK_ARG:
-            emitfln("\tmov %s, %s", get_operand(ir->lhs), get_address(ir->dst));
+        }
+        case IR_TAIL_CALL:
+            emit_args(ir);
+            emitfln("\tmov $0, %%rax");
+            emit_epilogue(fn);
+            emitfln("\tjmp %s", ir->funcname);
             break;
         case IR_ADD:
+            emit_mov(ir->lhs, ir->dst);
             emitfln("\tadd %s, %s", get_operand(ir->rhs), get_operand(ir->dst));
             break;
         case IR_SUB:
+            emit_mov(ir->lhs, ir->dst);
             emitfln("\tsub %s, %s", get_operand(ir->rhs), get_operand(ir->dst));
             break;
         case IR_MUL:
+            emit_mov(ir->lhs, ir->dst);
             emitfln("\timul %s, %s", get_operand(ir->rhs),
                     get_operand(ir->dst));
             break;
@@ -233,6 +419,29 @@ static void codegen_fn(Function *fn) {
             emitfln("\tidiv %s", get_operand(ir->rhs));
             emitfln("\tmov %%rax, %s", get_operand(ir->dst));
             break;
+        case IR_MULH:
+            emitfln("\tmov %s, %%rax", get_operand(ir->lhs));
+            emitfln("\timul %s", get_operand(ir->rhs));
+            emitfln("\tmov %%rdx, %s", get_operand(ir->dst));
+            break;
+        case IR_SHL:
+            // lea scales by up to 8 and saves the copy
+            if (ir->val <= 3 && ir->lhs->reg != ir->dst->reg) {
+                emitfln("\tlea (,%s,%d), %s", get_operand(ir->lhs),
+                        1 << ir->val, get_operand(ir->dst));
+                break;
+            }
+            emit_mov(ir->lhs, ir->dst);
+            emitfln("\tshl $%ld, %s", ir->val, get_operand(ir->dst));
+            break;
+        case IR_SHR:
+            emit_mov(ir->lhs, ir->dst);
+            emitfln("\tshr $%ld, %s", ir->val, get_operand(ir->dst));
+            break;
+        case IR_SAR:
+            emit_mov(ir->lhs, ir->dst);
+            emitfln("\tsar $%ld, %s", ir->val, get_operand(ir->dst));
+            break;
         case IR_EQ:
             emitfln("\tcmp %s, %s", get_operand(ir->rhs), get_operand(ir->lhs));
             emitfln("\tsete %%al");
@@ -253,25 +462,49 @@ static void codegen_fn(Function *fn) {
             emitfln("\tsetle %%al");
             emitfln("\tmovzx %%al, %s", get_operand(ir->dst));
             break;
+        case IR_SELECT:
+            emit_select(ir);
+            break;
         case IR_RETURN:
             emitfln("\tmov %s, %%rax", get_operand(ir->lhs));
-            emitfln("\tjmp .L.return.%s", fn->name);
+            if (ir->next)
+                emitfln("\tjmp .L.return.%s", fn->name);
             break;
         default:
             error("unknown IR operator");
         }
     }
     emitfln(".L.return.%s:", fn->name);
-    emitfln("\tmov -8(%%rbp), %%r12");
-    emitfln("\tmov -16(%%rbp), %%r13");
-    emitfln("\tmov -24(%%rbp), %%r14");
-    emitfln("\tmov -32(%%rbp), %%r15");
-    emitfln("\tmov %%rbp, %%rsp");
-    emitfln("\tpop %%rbp");
+    emit_epilogue(fn);
     emitfln("\tret");
 }
+
+// Moves the allocator left behind, reloads of a value just spilled, and
+// shorter encodings. xor clobbers the flags, which is fine as no flags
+// live from one IR to the next. A spilled value is stored and reloaded
+// through %r10 or %r11, which hold nothing once the IR that needed them is
+// done, so a copy passing through one of them can go direct.
+static PeepRule peep_rules[] = {
+    {"self-move", {"mov R, R"}, {}},
+    {"move-back", {"mov R, S", "mov S, R"}, {"mov R, S"}},
+    {"reload", {"mov R, M", "mov M, R"}, {"mov R, M"}},
+    {"reload-copy", {"mov R, M", "mov M, S"}, {"mov R, M", "mov R, S"}},
+    {"store-via-r10", {"mov R, %r10", "mov %r10, M"}, {"mov R, M"}},
+    {"store-via-r11", {"mov R, %r11", "mov %r11, M"}, {"mov R, M"}},
+    {"load-via-r10", {"mov M, %r10", "mov %r10, R"}, {"mov M, R"}},
+    {"load-via-r11", {"mov M, %r11", "mov %r11, R"}, {"mov M, R"}},
+    {"test-zero", {"cmp $0, R"}, {"test R, R"}},
+    {"xor-zero", {"mov $0, R"}, {"xor R, R"}},
+    {"jump-to-next", {"jmp L", "L:"}, {"L:"}},
+};
+
 void codegen_x64(Program *prog) {
+    int nrules = sizeof(peep_rules) / sizeof(*peep_rules);
     for (Function *fn = prog->fns; fn; fn = fn->next) {
         codegen_fn(fn);
+        peephole(peep_rules, nrules);
+        flush_insts();
     }
+    if (opt_stats)
+        print_peephole_stats(peep_rules, nrules);
 }
@@ -0,0 +1,228 @@
+#include "lucc.h"
+
+// Function inlining.
+//
+// A call to a small function defined in the same program is replaced by a
+// copy of the callee's IR, so that the passes running afterwards can
+// optimize across the former call boundary. The copy gets fresh
+// registers and labels. The parameters become locals of the
+// caller initialized with the arguments, and every return becomes a copy
+// to the call's result followed by a jump past the inlined body.
+//
+// The locals of a copy are dead once control leaves it, and the copies
+// made in one caller are neither nested nor run at the same time. So the
+// first copy of a callee gets fresh locals and the later copies share
+// them. Otherwise each call of a function with an array would add
+// another array to the frame.
+//
+// Functions are processed callees first, so a callee has its own calls
+// inlined before it is copied anywhere. Functions calling themselves are
+// never inlined.
+
+// callee register id - reg_base -> copy in the caller
+static int reg_base;
+static Operand **regs;
+
+// callee label id - label_base -> copy in the caller
+static int label_base;
+static Operand **labels;
+
+// callee variable vars_from[i] -> caller variable vars_to[i]
+static Var **vars_from, **vars_to;
+static int nvars;
+
+// the locals given to the callees inlined so far into the current caller
+typedef struct InlinedVars InlinedVars;
+struct InlinedVars {
+    InlinedVars *next;
+    Function *callee;
+    Var **vars;
+};
+static InlinedVars *inlined;
+
+static Function *find_function(Program *prog, char *name) {
+    for (Function *fn = prog->fns; fn; fn = fn->next)
+        if (!strcmp(fn->name, name))
+            return fn;
+    return NULL;
+}
+
+static int count_params(Function *fn) {
+    int n = 0;
+    for (Var *v = fn->params; v; v = v->next)
+        n++;
+    return n;
+}
+
+static bool is_inlinable(Function *fn, int nargs) {
+    if (count_params(fn) != nargs)
+        return false;
+    int size = 0;
+    for (IR *ir = fn->irs; ir; ir = ir->next) {
+        if (ir->kind == IR_CALL && !strcmp(ir->funcname, fn->name))
+            return false;
+        if (ir->kind != IR_LABEL && ir->kind != IR_NOP)
+            size++;
+    }
+    return size <= opt_inline_limit;
+}
+
+static int label_span(Function *fn, int *base) {
+    int lo = -1, hi = -1;
+    for (IR *ir = fn->irs; ir; ir = ir->next) {
+        Operand *label = ir->kind == IR_LABEL ? ir->lhs : jump_target(ir);
+        if (!label)
+            continue;
+        if (lo == -1 || label->id < lo)
+            lo = label->id;
+        if (label->id > hi)
+            hi = label->id;
+    }
+    *base = lo;
+    return lo == -1 ? 0 : hi - lo + 1;
+}
+
+static Var *copy_var(Var *var) {
+    for (int i = 0; i < nvars; i++)
+        if (vars_from[i] == var)
+            return vars_to[i];
+    error("inline: unknown variable: %s", var->name);
+}
+
+static Operand *copy_operand(Operand *op) {
+    if (!op)
+        return NULL;
+    switch (op->kind) {
+    case OP_REGISTER:
+        if (!regs[op->id - reg_base])
+            regs[op->id - reg_base] = new_register(op->ty);
+        return regs[op->id - reg_base];
+    case OP_LABEL:
+        if (!labels[op->id - label_base])
+            labels[op->id - label_base] = new_label(op->name);
+        return labels[op->id - label_base];
+    case OP_SYMBOL:
+        return new_symbol(copy_var(op->var));
+    }
+    error("inline: unknown operand");
+}
+
+// Gives every local of the callee, parameters included, a copy in the
+// caller, keeping their relative order in the frame.
+static void map_vars(Function *caller, Function *callee) {
+    nvars = 0;
+    for (Var *v = callee->locals; v; v = v->next)
+        nvars++;
+    vars_from = arena_alloc(&opt_arena, sizeof(Var *) * nvars);
+    int i = 0;
+    for (Var *v = callee->locals; v; v = v->next)
+        vars_from[i++] = v;
+
+    for (InlinedVars *iv = inlined; iv; iv = iv->next) {
+        if (iv->callee == callee) {
+            vars_to = iv->vars;
+            return;
+        }
+    }
+    vars_to = arena_alloc(&opt_arena, sizeof(Var *) * nvars);
+    InlinedVars *iv = arena_alloc(&opt_arena, sizeof(InlinedVars));
+    *iv = (InlinedVars){inlined, callee, vars_to};
+    inlined = iv;
+
+    Var head = {};
+    Var *cur = &head;
+    i = 0;
+    for (Var *v = callee->locals; v; v = v->next)
+        vars_to[i++] = cur = cur->next = new_var(v->name, v->ty);
+    cur->next = caller->locals;
+    caller->locals = head.next;
+}
+
+// Replaces call, which follows prev, with a copy of callee and returns
+// the last IR of the copy.
+static IR *inline_call(Function *caller, IR *prev, IR *call,
+                       Function *callee) {
+    int nregs = reg_span(callee, &reg_base);
+    int nlabels = label_span(callee, &label_base);
+    regs = arena_alloc(&opt_arena, sizeof(Operand *) * nregs);
+    labels = arena_alloc(&opt_arena, sizeof(Operand *) * nlabels);
+    map_vars(caller, callee);
+
+    // When the call's result is returned right away, the callee's returns
+    // can stay returns. This keeps tail calls in the callee tail calls.
+    bool tail = call->next && call->next->kind == IR_RETURN &&
+                call->next->lhs == call->dst;
+
+    // fn->params lists the parameters last to first.
+    IR *cur = prev;
+    int i = call->nargs;
+    for (Var *v = callee->params; v; v = v->next)
+        cur = new_ir(cur, IR_STORE, new_symbol(copy_var(v)), call->args[--i],
+                     NULL);
+
+    Operand *end = new_label("inline_end");
+    for (IR *ir = callee->irs; ir; ir = ir->next) {
+        if (ir->kind == IR_RETURN && !tail) {
+            cur = new_ir(cur, IR_MOV, copy_operand(ir->lhs), NULL, call->dst);
+            cur = new_ir(cur, IR_JMP, end, NULL, NULL);
+            continue;
+        }
+        cur = new_ir(cur, ir->kind, copy_operand(ir->lhs),
+                     copy_operand(ir->rhs), copy_operand(ir->dst));
+        cur->val = ir->val;
+        if (ir->kind == IR_CALL) {
+            cur->funcname = ir->funcname;
+            cur->nargs = ir->nargs;
+            cur->args = arena_alloc(&ir_arena, sizeof(Operand *) * ir->nargs);
+            for (int i = 0; i < ir->nargs; i++)
+                cur->args[i] = copy_operand(ir->args[i]);
+        }
+    }
+    cur = new_ir(cur, IR_LABEL, end, NULL, NULL);
+    cur->next = call->next;
+
+    return cur;
+}
+
+static void inline_calls(Program *prog, Function *fn, bool *visited) {
+    int idx = 0;
+    for (Function *f = prog->fns; f != fn; f = f->next)
+        idx++;
+    if (visited[idx])
+        return;
+    visited[idx] = true;
+
+    for (IR *ir = fn->irs; ir; ir = ir->next) {
+        if (ir->kind != IR_CALL)
+            continue;
+        Function *callee = find_function(prog, ir->funcname);
+        if (callee)
+            inline_calls(prog, callee, visited);
+    }
+
+    inlined = NULL;
+    IR head = {.next = fn->irs};
+    for (IR *prev = &head; prev->next;) {
+        IR *ir = prev->next;
+        Function *callee =
+            ir->kind == IR_CALL ? find_function(prog, ir->funcname) : NULL;
+        if (callee && callee != fn && is_inlinable(callee, ir->nargs)) {
+            prev = inline_call(fn, prev, ir, callee);
+            fn->irs = head.next;
+        } else {
+            prev = ir;
+        }
+    }
+    renumber(fn);
+}
+
+void inline_functions(Program *prog) {
+    if (opt_inline_limit <= 0)
+        return;
+    int nfns = 0;
+    for (Function *fn = prog->fns; fn; fn = fn->next)
+        nfns++;
+    bool *visited = arena_alloc(&opt_arena, sizeof(bool) * nfns);
+    for (Function *fn = prog->fns; fn; fn = fn->next)
+        inline_calls(prog, fn, visited);
+}
@@ -3,17 +3,9 @@
 static int reg_id;
 static int sym_id;
 static int label_id;
-Function *current_fn;
-
-static Var *new_lvar(char *name, Type *ty) {
-    Var *var = new_var(name, ty);
-    var->next = current_fn->locals;
-    current_fn->locals = var;
-    return var;
-}
 
 Operand *new_operand(OperandKind kind) {
-    Operand *op = calloc(1, sizeof(Operand));
+    Operand *op = arena_alloc(&ir_arena, sizeof(Operand));
     op->kind = kind;
     return op;
 }
@@ -36,20 +28,163 @@ Operand *new_label(char *name) {
     op->name = name;
     return op;
 }
+Operand *new_address(void) {
+    Operand *op = new_operand(OP_ADDRESS);
+    op->scale = 1;
+    return op;
+}
 
+Operand *new_imm(long val) {
+    Operand *op = new_operand(OP_IMM);
+    op->val = val;
+    return op;
+}
+
+// Inserts a new IR right after cur.
 IR *new_ir(IR *cur, IRKind kind, Operand *lhs, Operand *rhs, Operand *dst) {
-    IR *ir = calloc(1, sizeof(IR));
+    IR *ir = arena_alloc(&ir_arena, sizeof(IR));
     ir->kind = kind;
     ir->lhs = lhs;
     ir->rhs = rhs;
     ir->dst = dst;
+    ir->next = cur->next;
     cur->next = ir;
     return ir;
 }
 
+// Returns the label ir may jump to, or NULL if it never jumps.
+Operand *jump_target(IR *ir) {
+    switch (ir->kind) {
+    case IR_JMP:
+    case IR_JMPIFZERO:
+    case IR_JMPIFNONZERO:
+        return ir->lhs;
+    case IR_BEQ:
+    case IR_BNE:
+    case IR_BLT:
+    case IR_BLE:
+    case IR_BGT:
+    case IR_BGE:
+        return ir->dst;
+    }
+    return NULL;
+}
+
+// Collects pointers to the register operands read by ir so that passes
+// can both inspect and rewrite them. Returns the number of operands.
+static int operand_uses(Operand **op, Operand ***uses) {
+    if (!*op)
+        return 0;
+    if ((*op)->kind == OP_REGISTER) {
+        uses[0] = op;
+        return 1;
+    }
+    int n = 0;
+    if ((*op)->kind == OP_ADDRESS) {
+        if ((*op)->base)
+            uses[n++] = &(*op)->base;
+        if ((*op)->index)
+            uses[n++] = &(*op)->index;
+    }
+    return n;
+}
+
+int ir_uses(IR *ir, Operand ***uses) {
+    int n = 0;
+    n += operand_uses(&ir->lhs, uses + n);
+    n += operand_uses(&ir->rhs, uses + n);
+    for (int i = 0; i < ir->nphi; i++)
+        if (ir->phi_vals[i])
+            uses[n++] = &ir->phi_vals[i];
+    for (int i = 0; i < ir->nargs; i++)
+        uses[n++] = &ir->args[i];
+    return n;
+}
+// Returns a pointer to the register operand written by ir, or NULL.
+Operand **ir_def(IR *ir) {
+    if (ir->dst && ir->dst->kind == OP_REGISTER)
+        return &ir->dst;
+    return NULL;
+}
+
+// Returns how many ids the registers of fn span and stores the lowest one
+// in *base, so that passes can keep per-register tables indexed by
+// id - *base.
+int reg_span(Function *fn, int *base) {
+    int lo = -1, hi = -1;
+    for (IR *ir = fn->irs; ir; ir = ir->next) {
+        Operand **ops[MAX_USES(ir) + 1];
+        int n = ir_uses(ir, ops);
+        Operand **def = ir_def(ir);
+        if (def)
+            ops[n++] = def;
+        for (int i = 0; i < n; i++) {
+            int id = (*ops[i])->id;
+            if (lo == -1 || id < lo)
+                lo = id;
+            if (id > hi)
+                hi = id;
+        }
+    }
+    *base = lo;
+    return lo == -1 ? 0 : hi - lo + 1;
+}
+
+// Registers and labels are numbered in creation order across the whole
+// program, so the ids a pass creates in one function come after those of
+// every function irgen made. Renumbering gives fn's operands consecutive
+// fresh ids again, which keeps the spans above, and every table indexed
+// by them, proportional to fn. With reset set, marks the operands instead.
+static void renumber_operand(Operand *op, bool reset) {
+    if (!op)
+        return;
+    if (op->kind == OP_ADDRESS) {
+        renumber_operand(op->base, reset);
+        renumber_operand(op->index, reset);
+        return;
+    }
+    if (op->kind != OP_REGISTER && op->kind != OP_LABEL)
+        return;
+    if (reset)
+        op->id = -1;
+    else if (op->id == -1)
+        op->id = op->kind == OP_REGISTER ? reg_id++ : label_id++;
+}
+
+void renumber(Function *fn) {
+    for (int pass = 0; pass < 2; pass++) {
+        bool reset = (pass == 0);
+        for (IR *ir = fn->irs; ir; ir = ir->next) {
+            renumber_operand(ir->lhs, reset);
+            renumber_operand(ir->rhs, reset);
+            renumber_operand(ir->dst, reset);
+            for (int i = 0; i < ir->nargs; i++)
+                renumber_operand(ir->args[i], reset);
+            for (int i = 0; i < ir->nphi; i++) {
+                renumber_operand(ir->phi_vals[i], reset);
+                renumber_operand(ir->phi_labels[i], reset);
+            }
+        }
+    }
+}
+
 Operand *irgen_addr(IR *cur, IR **code, Node *node);
 Operand *irgen_expr(IR *cur, IR **code, Node *node);
 
+// __builtin_expect(x, c) is x, which the program expects to equal c.
+static bool is_expect(Node *node) {
+    return node->kind == ND_FUNCALL &&
+           !strcmp(node->funcname, "__builtin_expect") && node->nargs == 2;
+}
+
+// Returns 1 if the condition is expected to hold, -1 if not and 0 if
+// nothing is known.
+static int expected(Node *cond) {
+    if (!is_expect(cond) || cond->args->next->kind != ND_NUM)
+        return 0;
+    return cond->args->next->val ? 1 : -1;
+}
+
 Operand *irgen_addr(IR *cur, IR **code, Node *node) {
     if (node->kind == ND_VAR)
         return new_symbol(node->var);
@@ -67,14 +202,17 @@ Operand *irgen_expr(IR *cur, IR **code, Node *node) {
         return cur->dst;
     }
     case ND_FUNCALL: {
-        Var **args = calloc(node->nargs, sizeof(Var));
-        int gp = 0;
-        for (Node *n = node->args; n; n = n->next) {
-            Operand *arg = irgen_expr(cur, &cur, n);
-            Var *argvar = new_lvar("", n->ty);
-            cur = new_ir(cur, IR_STACK_ARG, arg, NULL, new_symbol(argvar));
-            args[gp++] = argvar;
+        if (is_expect(node)) {
+            Operand *val = irgen_expr(cur, &cur, node->args);
+            irgen_expr(cur, &cur, node->args->next);
+            *code = cur;
+            return val;
         }
+        Operand **args =
+            arena_alloc(&ir_arena, sizeof(Operand *) * node->nargs);
+        int gp = 0;
+        for (Node *n = node->args; n; n = n->next)
+            args[gp++] = irgen_expr(cur, &cur, n);
         cur = new_ir(cur, IR_CALL, NULL, NULL, new_register(node->ty));
         cur->funcname = node->funcname;
         cur->args = args;
@@ -88,11 +226,9 @@ Operand *irgen_expr(IR *cur, IR **code, Node *node) {
         }
         Operand *lhs = irgen_addr(cur, &cur, node->lhs);
         Operand *rhs = irgen_expr(cur, &cur, node->rhs);
-        Operand *dst = new_register(node->ty);
-        cur = new_ir(cur, IR_STORE, lhs, rhs, dst);
-        cur = new_ir(cur, IR_FREE, lhs, NULL, NULL);
+        cur = new_ir(cur, IR_STORE, lhs, rhs, NULL);
         *code = cur;
-        return dst;
+        return rhs;
     }
     case ND_VAR: {
         Operand *lhs = irgen_addr(cur, &cur, node);
@@ -120,42 +256,34 @@ Operand *irgen_expr(IR *cur, IR **code, Node *node) {
     switch (node->kind) {
     case ND_ADD:
         cur = new_ir(cur, IR_ADD, lhs, rhs, dst);
-        cur = new_ir(cur, IR_FREE, rhs, NULL, NULL);
         *code = cur;
         return dst;
     case ND_SUB:
         cur = new_ir(cur, IR_SUB, lhs, rhs, dst);
-        cur = new_ir(cur, IR_FREE, rhs, NULL, NULL);
         *code = cur;
         return dst;
     case ND_MUL:
         cur = new_ir(cur, IR_MUL, lhs, rhs, dst);
-        cur = new_ir(cur, IR_FREE, rhs, NULL, NULL);
         *code = cur;
         return dst;
     case ND_DIV:
         cur = new_ir(cur, IR_DIV, lhs, rhs, dst);
-        cur = new_ir(cur, IR_FREE, rhs, NULL, NULL);
         *code = cur;
         return dst;
     case ND_EQ:
         cur = new_ir(cur, IR_EQ, lhs, rhs, dst);
-        cur = new_ir(cur, IR_FREE, rhs, NULL, NULL);
         *code = cur;
         return dst;
     case ND_NE:
         cur = new_ir(cur, IR_NE, lhs, rhs, dst);
-        cur = new_ir(cur, IR_FREE, rhs, NULL, NULL);
         *code = cur;
         return dst;
     case ND_LT:
         cur = new_ir(cur, IR_LT, lhs, rhs, dst);
-        cur = new_ir(cur, IR_FREE, rhs, NULL, NULL);
         *code = cur;
         return dst;
     case ND_LE:
         cur = new_ir(cur, IR_LE, lhs, rhs, dst);
-        cur = new_ir(cur, IR_FREE, rhs, NULL, NULL);
         *code = cur;
         return dst;
     }
@@ -171,28 +299,38 @@ void irgen_stmt(IR *cur, IR **code, Node *node) {
             irgen_stmt(cur, &cur, n);
         break;
     case ND_EXPR_STMT: {
-        Operand *ret = irgen_expr(cur, &cur, node->lhs);
-        cur = new_ir(cur, IR_FREE, ret, NULL, NULL);
+        irgen_expr(cur, &cur, node->lhs);
         break;
     }
     case ND_FOR: {
+        // The loop is rotated: the condition is tested once on entry and
+        // then at the bottom, so an iteration takes a single branch. The
+        // empty preheader gives the loop a block entering it alone.
+        Operand *pre = new_label("preheader");
         Operand *begin = new_label("begin");
         Operand *cont = new_label("continue");
         Operand *end = new_label("end");
         if (node->init)
             irgen_stmt(cur, &cur, node->init);
-        cur = new_ir(cur, IR_LABEL, begin, NULL, NULL);
         if (node->cond) {
             Operand *cond = irgen_expr(cur, &cur, node->cond);
             cur = new_ir(cur, IR_JMPIFZERO, end, cond, NULL);
-            cur = new_ir(cur, IR_FREE, cond, NULL, NULL);
+            cur->val = -expected(node->cond);
         }
+        cur = new_ir(cur, IR_LABEL, pre, NULL, NULL);
+        cur = new_ir(cur, IR_LABEL, begin, NULL, NULL);
         irgen_stmt(cur, &cur, node->then);
         cur = new_ir(cur, IR_LABEL, cont, NULL, NULL);
         if (node->inc)
             irgen_stmt(cur, &cur, node->inc);
 
-        cur = new_ir(cur, IR_JMP, begin, NULL, NULL);
+        if (node->cond) {
+            Operand *cond = irgen_expr(cur, &cur, node->cond);
+            cur = new_ir(cur, IR_JMPIFNONZERO, begin, cond, NULL);
+            cur->val = expected(node->cond);
+        } else {
+            cur = new_ir(cur, IR_JMP, begin, NULL, NULL);
+        }
         cur = new_ir(cur, IR_LABEL, end, NULL, NULL);
         break;
     }
@@ -201,7 +339,7 @@ void irgen_stmt(IR *cur, IR **code, Node *node) {
         Operand *end = new_label("end");
         Operand *cond = irgen_expr(cur, &cur, node->cond);
         cur = new_ir(cur, IR_JMPIFZERO, els, cond, NULL);
-        cur = new_ir(cur, IR_FREE, cond, NULL, NULL);
+        cur->val = -expected(node->cond);
         irgen_stmt(cur, &cur, node->then);
         cur = new_ir(cur, IR_JMP, end, NULL, NULL);
         cur = new_ir(cur, IR_LABEL, els, NULL, NULL);
@@ -222,7 +360,6 @@ void irgen_stmt(IR *cur, IR **code, Node *node) {
 
 void irgen(Program *prog) {
     for (Function *fn = prog->fns; fn; fn = fn->next) {
-        current_fn = fn;
         IR head = {};
         IR *cur = &head;
         for (Node *n = fn->nodes; n; n = n->next) {
@@ -0,0 +1,341 @@
+#include "lucc.h"
+
+// Instruction selection by tree tiling.
+//
+// Within a basic block, the definition of a register read exactly once
+// can be folded into the instruction reading it, which turns the IR into
+// a forest of expression trees. Each backend describes what its
+// instructions can cover with a table of rules in the style of BURS: a
+// rule derives a nonterminal, such as "register" or "address", from an IR
+// whose operands derive the nonterminals it lists, at a cost. A bottom-up
+// pass labels every tree node with the cheapest rule for each
+// nonterminal, and the root is then rewritten to the tiling found, with
+// folded address computations becoming OP_ADDRESS operands, folded
+// constants OP_IMM operands, and the IRs they covered deleted.
+//
+// A constant can be folded into any number of instructions anywhere in
+// the function; its IR_IMM goes away once all its readers took it in.
+//
+// The trees are rebuilt for every root from the IR list, so the pass only
+// runs once, right before register allocation.
+
+#define INF (1 << 29)
+
+typedef struct Tree Tree;
+struct Tree {
+    IR *ir;      // NULL for a leaf
+    Operand *op; // register holding the value of the tree
+    Tree *kids[2];
+    int cost[NUM_NT];
+    Rule *rule[NUM_NT];
+};
+
+bool is_scalar_load(IR *ir) {
+    return ir->kind == IR_LOAD && ir->dst->ty->kind != TY_ARRAY &&
+           ir->lhs->kind == OP_REGISTER;
+}
+
+bool is_symbol_load(IR *ir) {
+    return ir->kind == IR_LOAD && ir->dst->ty->kind != TY_ARRAY &&
+           ir->lhs->kind == OP_SYMBOL;
+}
+
+// The IR computes the address of a local.
+bool is_frame_addr(IR *ir) {
+    if (ir->kind == IR_ADDR)
+        return ir->lhs->kind == OP_SYMBOL;
+    return ir->kind == IR_LOAD && ir->dst->ty->kind == TY_ARRAY &&
+           ir->lhs->kind == OP_SYMBOL;
+}
+
+// The "load" of an array through a pointer yields the pointer itself.
+bool is_array_view(IR *ir) {
+    return ir->kind == IR_LOAD && ir->dst->ty->kind == TY_ARRAY &&
+           ir->lhs->kind == OP_REGISTER;
+}
+
+static Rule *rules;
+static int nrules;
+
+// per register, indexed by id - reg_base
+static int reg_base;
+static int *ndefs, *nuses;
+static IR **defs;
+
+// the block being selected and the root being tiled
+static IR **code;
+static int ncode;
+static int root;
+
+static void count_defs_and_uses(Function *fn) {
+    int n = reg_span(fn, &reg_base);
+    ndefs = arena_alloc(&codegen_arena, sizeof(int) * n);
+    nuses = arena_alloc(&codegen_arena, sizeof(int) * n);
+    defs = arena_alloc(&codegen_arena, sizeof(IR *) * n);
+    for (IR *ir = fn->irs; ir; ir = ir->next) {
+        Operand **uses[MAX_USES(ir)];
+        int cnt = ir_uses(ir, uses);
+        for (int i = 0; i < cnt; i++)
+            nuses[(*uses[i])->id - reg_base]++;
+        Operand **def = ir_def(ir);
+        if (def) {
+            ndefs[(*def)->id - reg_base]++;
+            defs[(*def)->id - reg_base] = ir;
+        }
+    }
+}
+
+static int index_in_block(IR *ir) {
+    for (int i = 0; i < ncode; i++)
+        if (code[i] == ir)
+            return i;
+    return -1;
+}
+
+static bool writes_memory(IR *ir) {
+    return ir->kind == IR_STORE || ir->kind == IR_CALL ||
+           ir->kind == IR_TAIL_CALL;
+}
+
+// Whether ir can be moved down to the root: its operands, and the memory
+// it loads from, must still hold the same values there.
+static bool can_fold(IR *ir) {
+    int i = index_in_block(ir);
+    if (i == -1 || i >= root)
+        return false;
+    for (int j = i + 1; j < root; j++) {
+        if ((is_scalar_load(ir) || is_symbol_load(ir)) &&
+            writes_memory(code[j]))
+            return false;
+        Operand **def = ir_def(code[j]);
+        if (!def)
+            continue;
+        if ((ir->lhs && *def == ir->lhs) || (ir->rhs && *def == ir->rhs))
+            return false;
+    }
+    return true;
+}
+
+static bool has_rules(IR *ir) {
+    for (int i = 0; i < nrules; i++)
+        if (rules[i].kind == ir->kind)
+            return true;
+    return false;
+}
+
+static Tree *new_leaf(Operand *op) {
+    Tree *t = arena_alloc(&codegen_arena, sizeof(Tree));
+    t->op = op;
+    return t;
+}
+
+static bool is_foldable(Operand *op) {
+    int r = op->id - reg_base;
+    IR *def = defs[r];
+    if (ndefs[r] != 1 || !has_rules(def))
+        return false;
+    if (def->kind == IR_IMM)
+        return true;
+    return nuses[r] == 1 && can_fold(def);
+}
+
+static Tree *build_tree(IR *ir) {
+    Tree *t = arena_alloc(&codegen_arena, sizeof(Tree));
+    t->ir = ir;
+    t->op = ir->dst;
+    Operand *ops[] = {ir->lhs, ir->rhs};
+    for (int i = 0; i < 2; i++) {
+        Operand *op = ops[i];
+        if (!op || op->kind != OP_REGISTER)
+            continue;
+        if (is_foldable(op))
+            t->kids[i] = build_tree(defs[op->id - reg_base]);
+        else
+            t->kids[i] = new_leaf(op);
+    }
+    return t;
+}
+
+static bool matches(Rule *rule, Tree *t) {
+    if (rule->kind != t->ir->kind || (rule->cond && !rule->cond(t->ir)))
+        return false;
+    for (int i = 0; i < 2; i++) {
+        if (!rule->kids[i] != !t->kids[i])
+            return false;
+        if (rule->kids[i] && t->kids[i]->cost[rule->kids[i]] >= INF)
+            return false;
+    }
+    return true;
+}
+
+static void label(Tree *t) {
+    for (int nt = 0; nt < NUM_NT; nt++)
+        t->cost[nt] = INF;
+
+    if (!t->ir) {
+        t->cost[NT_REG] = 0;
+    } else {
+        for (int i = 0; i < 2; i++)
+            if (t->kids[i])
+                label(t->kids[i]);
+        for (int i = 0; i < nrules; i++) {
+            Rule *rule = &rules[i];
+            if (!matches(rule, t))
+                continue;
+            int cost = rule->cost;
+            for (int j = 0; j < 2; j++)
+                if (rule->kids[j])
+                    cost += t->kids[j]->cost[rule->kids[j]];
+            if (cost < t->cost[rule->nt]) {
+                t->cost[rule->nt] = cost;
+                t->rule[rule->nt] = rule;
+            }
+        }
+        // An IR no rule covers is still computed into a register by itself.
+        if (t->cost[NT_REG] >= INF && ir_def(t->ir))
+            t->cost[NT_REG] = 1;
+    }
+
+    // Chain rules may feed each other; costs only ever go down.
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 0; i < nrules; i++) {
+            Rule *rule = &rules[i];
+            if (rule->kind != CHAIN_RULE || t->cost[rule->kids[0]] >= INF)
+                continue;
+            int cost = t->cost[rule->kids[0]] + rule->cost;
+            if (cost < t->cost[rule->nt]) {
+                t->cost[rule->nt] = cost;
+                t->rule[rule->nt] = rule;
+                changed = true;
+            }
+        }
+    }
+}
+
+// The IR of a tree covered by a rule of its parent disappears, once no
+// other reader needs it.
+static void fold(Tree *t) {
+    if (t->ir != code[root] && --nuses[t->ir->dst->id - reg_base] == 0)
+        t->ir->kind = IR_NOP;
+}
+
+// Adds the part of an address that t derives as nt to addr.
+static void reduce_addr(Tree *t, Nonterm nt, Operand *addr) {
+    Rule *rule = t->rule[nt];
+    if (rule->kind == CHAIN_RULE) {
+        if (rule->kids[0] != NT_REG) {
+            reduce_addr(t, rule->kids[0], addr);
+        } else if (nt == NT_INDEX) {
+            addr->index = t->op;
+            addr->scale = 1;
+        } else {
+            addr->base = t->op;
+        }
+        return;
+    }
+
+    IR *ir = t->ir;
+    IRKind kind = ir->kind;
+    fold(t);
+    switch (kind) {
+    case IR_IMM:
+        addr->disp += ir->val;
+        return;
+    case IR_SHL:
+        addr->index = t->kids[0]->op;
+        addr->scale = 1 << ir->val;
+        return;
+    case IR_LOAD:
+    case IR_ADDR:
+        if (ir->lhs->kind == OP_SYMBOL) {
+            addr->var = ir->lhs->var;
+            return;
+        }
+    }
+    for (int i = 0; i < 2; i++)
+        if (rule->kids[i])
+            reduce_addr(t->kids[i], rule->kids[i], addr);
+}
+
+static Operand *make_addr(Tree *t, Nonterm nt) {
+    Operand *addr = new_address();
+    reduce_addr(t, nt, addr);
+    return addr;
+}
+
+// Rewrites the root to the cheapest tiling of its tree.
+static void reduce(Tree *t) {
+    IR *ir = t->ir;
+    Nonterm nt = ir_def(ir) ? NT_REG : NT_STMT;
+    Rule *rule = t->rule[nt];
+    if (!rule)
+        return;
+
+    if (rule->kind == CHAIN_RULE) {
+        // Only an address can be turned into a register by itself.
+        Operand *addr = make_addr(t, rule->kids[0]);
+        ir->kind = IR_ADDR;
+        ir->lhs = addr;
+        ir->rhs = NULL;
+        ir->val = 0;
+        return;
+    }
+
+    Operand **ops[] = {&ir->lhs, &ir->rhs};
+    for (int i = 0; i < 2; i++) {
+        Tree *kid = t->kids[i];
+        switch (rule->kids[i]) {
+        case NT_NONE:
+        case NT_REG:
+            break;
+        case NT_IMM:
+        case NT_ZERO:
+            *ops[i] = new_imm(kid->ir->val);
+            fold(kid);
+            break;
+        default:
+            *ops[i] = make_addr(kid, rule->kids[i]);
+        }
+    }
+}
+
+void select_instructions(Function *fn, Rule *rules_, int nrules_) {
+    rules = rules_;
+    nrules = nrules_;
+    renumber(fn);
+    count_defs_and_uses(fn);
+    build_cfg(fn);
+
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        ncode = 0;
+        for (IR *ir = bb->first;; ir = ir->next) {
+            ncode++;
+            if (ir == bb->last)
+                break;
+        }
+        code = arena_alloc(&codegen_arena, sizeof(IR *) * ncode);
+        IR *ir = bb->first;
+        for (int i = 0; i < ncode; i++, ir = ir->next)
+            code[i] = ir;
+
+        // Users come before the definitions they may absorb.
+        for (root = ncode - 1; root >= 0; root--) {
+            if (!has_rules(code[root]))
+                continue;
+            Tree *t = build_tree(code[root]);
+            label(t);
+            reduce(t);
+        }
+    }
+
+    IR head = {.next = fn->irs};
+    for (IR *prev = &head; prev->next;) {
+        if (prev->next->kind == IR_NOP)
+            prev->next = prev->next->next;
+        else
+            prev = prev->next;
+    }
+    fn->irs = head.next;
+    build_cfg(fn);
+}
@@ -4,12 +4,20 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdnoreturn.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 //
 // typedef
@@ -27,6 +35,39 @@ typedef enum {
     TK_RESERVED,
 } TokenKind;
 
+// Punctuators and keywords, which TK_RESERVED tokens carry in id
+typedef enum {
+    P_EQ,        // ==
+    P_NE,        // !=
+    P_LE,        // <=
+    P_GE,        // >=
+    P_LT,        // <
+    P_GT,        // >
+    P_ASSIGN,    // =
+    P_ADD,       // +
+    P_SUB,       // -
+    P_MUL,       // *
+    P_DIV,       // /
+    P_AMP,       // &
+    P_LPAREN,    // (
+    P_RPAREN,    // )
+    P_LBRACKET,  // [
+    P_RBRACKET,  // ]
+    P_LBRACE,    // {
+    P_RBRACE,    // }
+    P_SEMICOLON, // ;
+    P_COMMA,     // ,
+    KW_RETURN,
+    KW_IF,
+    KW_THEN,
+    KW_ELSE,
+    KW_FOR,
+    KW_WHILE,
+    KW_SIZEOF,
+    KW_INT,
+    NUM_RESERVED,
+} Reserved;
+
 typedef enum {
     ND_NUM,       // num
     ND_VAR,       // variable
@@ -55,28 +96,46 @@ typedef enum {
     IR_MOV,
     IR_LOAD,
     IR_STORE,
+    IR_PARAM, // dst = argument number val on entry
     IR_RETURN,
+    // Conditional branches tell in val whether they are likely (1) or
+    // unlikely (-1) to jump, or 0 if nothing is known.
     IR_JMP,
-    IR_JMPIFZERO,
-    IR_LABEL,
-    IR_FREE,
+    IR_JMPIFZERO,    // jump to lhs if rhs == 0
+    IR_JMPIFNONZERO, // jump to lhs if rhs != 0
+    IR_BEQ,          // branch to dst if lhs == rhs
+    IR_BNE,
+    IR_BLT,
+    IR_BLE,
+    IR_BGT,
+    IR_BGE,
+    IR_LABEL, // val: log2 of the alignment of the code that follows
+    IR_PHI,
     IR_CALL,
-    IR_STACK_ARG,
+    IR_TAIL_CALL, // call that returns the callee's result, ends the block
     IR_ADD,
     IR_SUB,
     IR_MUL,
     IR_DIV,
+    IR_MULH, // upper 64 bits of the signed product
+    IR_SHL,  // shifts lhs by val
+    IR_SHR,
+    IR_SAR,
     IR_ADDR,
     IR_EQ,
     IR_NE,
     IR_LT,
     IR_LE,
+    IR_SELECT, // dst = args[0] if branch kind val would jump on lhs, rhs,
+               // else args[1]
 } IRKind;
 
 typedef enum {
     OP_REGISTER, // register
     OP_SYMBOL,   // symbol
     OP_LABEL,    // label
+    OP_ADDRESS,  // memory address, see isel.c
+    OP_IMM,      // immediate, see isel.c
 } OperandKind;
 
 typedef enum {
@@ -95,14 +154,48 @@ typedef struct Program Program;
 typedef struct Operand Operand;
 typedef struct Register Register;
 typedef struct IR IR;
+typedef struct BasicBlock BasicBlock;
+typedef struct Loop Loop;
+typedef struct ArenaBlock ArenaBlock;
 
 //
 // main.c
 //
 extern bool opt_dump_ir1;
 extern bool opt_dump_ir2;
+extern bool opt_dump_ir_opt;
+extern bool opt_dump_cfg;
+extern bool opt_stats;
+extern bool opt_mem_stats;
+extern bool opt_zicond;
+extern int opt_inline_limit;
 extern TargetArch opt_target;
-void emitfln(char *fmt, ...);
+extern FILE *outfile;
+
+//
+// arena.c
+//
+typedef struct {
+    char *name;
+    ArenaBlock *blocks;
+    size_t used; // bytes handed out since the last release
+    size_t peak; // most bytes in use at once
+    size_t nobjs, nbytes, nblocks;
+} Arena;
+
+extern Arena tokens_arena;  // until the IR is built
+extern Arena ast_arena;     // until the IR is built
+extern Arena ir_arena;      // types, variables, names and the IR
+extern Arena opt_arena;     // until a function is optimized
+extern Arena cfg_arena;     // until the next build_cfg()
+extern Arena codegen_arena; // until a function's assembly is written
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_grow(Arena *arena, void *p, size_t old, size_t size);
+char *arena_strndup(Arena *arena, char *s, size_t n);
+char *arena_vprintf(Arena *arena, char *fmt, va_list ap);
+char *arena_printf(Arena *arena, char *fmt, ...);
+void arena_release(Arena *arena);
+void print_mem_stats(void);
 
 //
 // type.c
@@ -134,18 +227,22 @@ void add_type(Node *node);
 //
 // tokenize.c
 //
+// Tokens are stored one after the other in an array ending with TK_EOF,
+// so the next token is tok + 1.
 struct Token {
-    TokenKind kind;
-    Token *next;
-    char *loc;
-    int len;
-
-    long val;
+    uint32_t loc; // offset into the input
+    int32_t id;   // TK_RESERVED: a Reserved; TK_IDENT: unique per name
+    uint16_t len;
+    uint8_t kind; // a TokenKind
 };
 
 noreturn void error(char *, ...);
 noreturn void error_tok(Token *, char *, ...);
-Token *tokenize(char *);
+extern char *reserved_names[NUM_RESERVED];
+char *token_loc(Token *tok);
+char *symbol_name(int id);
+Token *tokenize(char *filename, char *input);
+Token *tokenize_file(char *path);
 
 //
 // parse.c
@@ -156,6 +253,7 @@ struct Var {
     int len; // name length
     int offset;
     Type *ty;
+    Operand *vreg; // set when promoted to a register
 };
 Var *new_var(char *name, Type *ty);
 
@@ -183,7 +281,16 @@ struct Function {
     char *name;
     Var *locals;
     Var *params;
-    int stacksize;
+    int stacksize; // bytes below the return address, saved registers included
+    int nspills;
+    unsigned used_regs; // pool registers assigned, see regalloc.c
+
+    // control-flow graph, see cfg.c
+    BasicBlock *bbs;
+    int nbbs;
+    BasicBlock **rpo; // reachable blocks in reverse postorder
+    int nrpo;
+    Loop *loops;
 };
 
 struct Program {
@@ -191,7 +298,7 @@ struct Program {
     Var *globals;
 };
 
-bool equal(Token *tok, char *p);
+bool equal(Token *tok, Reserved r);
 Program *parse(Token *);
 
 //
@@ -206,8 +313,15 @@ struct Operand {
     int id;
     Type *ty;
     Register *reg;
-    Var *var;
+    Var *var;   // symbol, or spill slot of a register
     char *name; // label name
+
+    // OP_ADDRESS: disp + (var ? address of var : base) + index * scale
+    Operand *base, *index;
+    int scale;
+    long disp;
+
+    long val; // OP_IMM
 };
 struct IR {
     IR *next;
@@ -215,12 +329,150 @@ struct IR {
     Operand *lhs, *rhs, *dst;
     long val;
     char *funcname;
-    Var **args;
+    Operand **args; // IR_CALL: argument values, IR_SELECT: the choices
     int nargs;
+    unsigned live_regs; // IR_CALL: pool registers live across the call
+
+    // IR_PHI: phi_vals[i] flows in from the block labeled phi_labels[i]
+    Operand **phi_vals;
+    Operand **phi_labels;
+    int nphi;
 };
 
+// upper bound of the operands ir_uses() may return for ir
+#define MAX_USES(ir) (4 + (ir)->nphi + (ir)->nargs)
+
+IR *new_ir(IR *cur, IRKind kind, Operand *lhs, Operand *rhs, Operand *dst);
+Operand *new_register(Type *ty);
+Operand *new_symbol(Var *var);
+Operand *new_label(char *name);
+Operand *new_address(void);
+Operand *new_imm(long val);
+Operand *jump_target(IR *ir);
+int ir_uses(IR *ir, Operand ***uses);
+Operand **ir_def(IR *ir);
+int reg_span(Function *fn, int *base);
+void renumber(Function *fn);
 void irgen(Program *);
 
+//
+// cfg.c
+//
+struct BasicBlock {
+    BasicBlock *next; // in IR list order
+    int id;
+    IR *first, *last;
+
+    BasicBlock **preds;
+    int npreds;
+    BasicBlock *succs[2];
+    int nsuccs;
+
+    int rpo; // index in reverse postorder, -1 if unreachable
+    BasicBlock *idom;
+    Loop *loop; // innermost loop containing the block
+    int loop_depth;
+};
+
+struct Loop {
+    Loop *next;
+    BasicBlock *header;
+    Loop *parent;
+    int depth;
+    bool *body; // indexed by block id
+    int nblocks;
+};
+
+void build_cfg(Function *fn);
+bool dominates(BasicBlock *a, BasicBlock *b);
+
+//
+// ssa.c
+//
+void to_ssa(Function *fn);
+void from_ssa(Function *fn);
+
+//
+// inline.c
+//
+void inline_functions(Program *);
+
+//
+// opt.c
+//
+void optimize(Program *);
+
+//
+// isel.c
+//
+typedef enum {
+    NT_NONE,
+    NT_REG,   // value in a register
+    NT_STMT,  // instruction without a result
+    NT_IMM,   // constant fitting the immediate field of the instruction
+    NT_ZERO,  // constant zero
+    NT_DISP,  // constant fitting an address displacement
+    NT_BASE,  // register or frame slot an address starts from
+    NT_INDEX, // register added to a base, possibly scaled
+    NT_BI,    // base + index
+    NT_ADDR,  // base + index + displacement
+    NT_MEM,   // value in memory usable as an instruction operand
+    NUM_NT,
+} Nonterm;
+
+#define CHAIN_RULE -1
+
+// Derives nt from an IR of the given kind whose lhs and rhs derive
+// kids[0] and kids[1], or, for a CHAIN_RULE, from kids[0] of the same IR.
+typedef struct {
+    Nonterm nt;
+    int kind;
+    Nonterm kids[2];
+    bool (*cond)(IR *ir);
+    int cost;
+} Rule;
+
+bool is_scalar_load(IR *ir);
+bool is_symbol_load(IR *ir);
+bool is_frame_addr(IR *ir);
+bool is_array_view(IR *ir);
+void select_instructions(Function *fn, Rule *rules, int nrules);
+
+//
+// regalloc.c
+//
+void alloc_regs(Function *fn, Register **regs, int nregs, Register **scratch);
+
+//
+// peephole.c
+//
+#define INST_MAX_ARGS 3
+#define PEEP_WINDOW 3
+
+// An assembly instruction, or with op NULL a label or directive line.
+typedef struct Inst Inst;
+struct Inst {
+    Inst *next;
+    char *op;
+    char *args[INST_MAX_ARGS];
+    int nargs;
+    char *line;
+};
+
+// Replaces the consecutive instructions in pat by those in repl; see
+// peephole.c for the notation.
+typedef struct {
+    char *name;
+    char *pat[PEEP_WINDOW];
+    char *repl[PEEP_WINDOW];
+    int hits;
+} PeepRule;
+
+void emitfln(char *fmt, ...);
+void peephole(PeepRule *rules, int nrules);
+void print_peephole_stats(PeepRule *rules, int nrules);
+void flush_insts(void);
+
 //
 // gen_x64.c
 //
@@ -236,3 +488,4 @@ void codegen_riscv(Program *);
 void print_tokens(Token *);
 void print_nodes(Node *);
 void print_ir(IR *);
+void print_cfg(Function *);
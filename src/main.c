@@ -2,17 +2,35 @@
 
 bool opt_dump_ir1;
 bool opt_dump_ir2;
+bool opt_dump_ir_opt;
+bool opt_dump_cfg;
+bool opt_stats;
+bool opt_mem_stats;
+bool opt_zicond;
+int opt_inline_limit;
 TargetArch opt_target;
+FILE *outfile;
 static char *input;
+static char *output;
+
+// Assembly is written a line at a time; the buffer turns that into a few
+// large writes. It is static because exit() flushes through it, including
+// from error() once the output is open.
+#define OUTPUT_BUFSIZE (1 << 20)
+static char outbuf[OUTPUT_BUFSIZE];
 
 static noreturn void usage(int code) {
-    fprintf(stderr, "Usage: lucc [--dump-ir1,--dump-ir2,--dump-ir]"
-                    "[-march=x86_64,riscv,llvm] <input>");
+    fprintf(stderr, "Usage: lucc [--dump-ir1,--dump-ir2,--dump-ir,--dump-ir-opt,"
+                    "--dump-cfg,--stats]"
+                    "[--mem-stats] [-march=x86_64,riscv,llvm] [-mzicond] "
+                    "[-finline-limit=N] "
+                    "[-o <output>] <file.c or program>\n");
     exit(code);
 }
 static void parse_args(int argc, char **argv) {
     input = NULL;
     opt_target = TARGET_X86_64;
+    opt_inline_limit = 20;
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "--help")) {
             usage(0);
@@ -31,6 +49,10 @@ static void parse_args(int argc, char **argv) {
                 continue;
             }
         }
+        if (!strcmp(argv[i], "-mzicond")) {
+            opt_zicond = true;
+            continue;
+        }
         if (!strcmp(argv[i], "--dump-ir1")) {
             opt_dump_ir1 = true;
             continue;
@@ -43,6 +65,36 @@ static void parse_args(int argc, char **argv) {
             opt_dump_ir1 = opt_dump_ir2 = true;
             continue;
         }
+        if (!strcmp(argv[i], "--dump-ir-opt")) {
+            opt_dump_ir_opt = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--dump-cfg")) {
+            opt_dump_cfg = true;
+            continue;
+        }
+        if (!strncmp(argv[i], "-finline-limit=", 15)) {
+            opt_inline_limit = atoi(argv[i] + 15);
+            continue;
+        }
+        if (!strcmp(argv[i], "-o")) {
+            if (++i == argc)
+                usage(1);
+            output = argv[i];
+            continue;
+        }
+        if (!strncmp(argv[i], "-o", 2)) {
+            output = argv[i] + 2;
+            continue;
+        }
+        if (!strcmp(argv[i], "--stats")) {
+            opt_stats = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--mem-stats")) {
+            opt_mem_stats = true;
+            continue;
+        }
         if (argv[i][0] == '-' && argv[i][1] != '\0') {
             error("unknown option: %s", argv[i]);
         }
@@ -52,30 +104,62 @@ static void parse_args(int argc, char **argv) {
         error("no input");
 }
 
-void emitfln(char *fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    vfprintf(stdout, fmt, ap);
-    fprintf(stdout, "\n");
+static void dump_ir(Program *prog, char *title) {
+    fprintf(stderr, "dump %s\n", title);
+    for (Function *fn = prog->fns; fn; fn = fn->next) {
+        for (IR *tmp = fn->irs; tmp; tmp = tmp->next) {
+            print_ir(tmp);
+        }
+    }
+}
+
+static bool is_source_file(char *path) {
+    int len = strlen(path);
+    return len > 2 && !strcmp(path + len - 2, ".c");
+}
+
+// The output is opened only once the program compiled, so that an error
+// leaves no truncated file behind.
+static void open_output(void) {
+    outfile = output && strcmp(output, "-") ? fopen(output, "w") : stdout;
+    if (!outfile)
+        error("cannot open %s: %s", output, strerror(errno));
+    setvbuf(outfile, outbuf, _IOFBF, OUTPUT_BUFSIZE);
+}
+
+static void close_output(void) {
+    if (fclose(outfile))
+        error("cannot write %s: %s", output ? output : "output",
+              strerror(errno));
 }
 
 int main(int argc, char **argv) {
     parse_args(argc, argv);
 
-    Token *tok = tokenize(input);
+    // An input naming a .c file is compiled from that file; anything else
+    // is the program itself.
+    Token *tok = is_source_file(input) ? tokenize_file(input)
+                                       : tokenize("<input>", input);
     Program *prog = parse(tok);
 
     irgen(prog);
-
-    if (opt_dump_ir1) {
-        fprintf(stderr, "dump ir 1\n");
+    if (opt_dump_ir1)
+        dump_ir(prog, "ir 1");
+    // Errors point at tokens only until here.
+    arena_release(&tokens_arena);
+    arena_release(&ast_arena);
+    optimize(prog);
+    if (opt_dump_ir_opt)
+        dump_ir(prog, "ir opt");
+    if (opt_dump_cfg) {
+        fprintf(stderr, "dump cfg\n");
         for (Function *fn = prog->fns; fn; fn = fn->next) {
-            for (IR *tmp = fn->irs; tmp; tmp = tmp->next) {
-                print_ir(tmp);
-            }
+            build_cfg(fn);
+            print_cfg(fn);
         }
     }
 
+    open_output();
     switch (opt_target) {
     case TARGET_X86_64:
         codegen_x64(prog);
@@ -86,5 +170,15 @@ int main(int argc, char **argv) {
     default:
         error("unsupported target");
     }
+    close_output();
+
+    if (opt_stats) {
+        for (Function *fn = prog->fns; fn; fn = fn->next) {
+            fprintf(stderr, "%s: spills %d frame %d\n", fn->name, fn->nspills,
+                    fn->stacksize);
+        }
+    }
+    if (opt_mem_stats)
+        print_mem_stats();
     return 0;
 }
@@ -0,0 +1,1582 @@
+#include "lucc.h"
+
+//
+// mem2reg
+//
+// Keeps scalar locals whose address is never taken in virtual registers
+// for the whole function, so their loads and stores become register moves.
+//
+// Taking the address of a scalar makes the frame layout observable through
+// pointer arithmetic (*(&x+1) reads the variable declared after x), so a
+// function doing that keeps all of its locals in memory.
+//
+
+static bool takes_scalar_addr(Function *fn) {
+    for (IR *ir = fn->irs; ir; ir = ir->next)
+        if (ir->kind == IR_ADDR && ir->lhs->var->ty->kind != TY_ARRAY)
+            return true;
+    return false;
+}
+
+static bool is_promotable(Function *fn, Var *var) {
+    if (var->ty->kind == TY_ARRAY)
+        return false;
+    for (IR *ir = fn->irs; ir; ir = ir->next) {
+        if (ir->kind == IR_LOAD || ir->kind == IR_STORE) {
+            if (ir->rhs && ir->rhs->kind == OP_SYMBOL && ir->rhs->var == var)
+                return false;
+            continue;
+        }
+        Operand *ops[] = {ir->lhs, ir->rhs, ir->dst};
+        for (int i = 0; i < 3; i++)
+            if (ops[i] && ops[i]->kind == OP_SYMBOL && ops[i]->var == var)
+                return false;
+    }
+    return true;
+}
+
+// Returns the argument number of var, or -1 if it is no parameter.
+static int param_index(Function *fn, Var *var) {
+    // fn->params lists the parameters last to first.
+    int n = 0, idx = -1;
+    for (Var *v = fn->params; v; v = v->next, n++)
+        if (v == var)
+            idx = n;
+    return idx == -1 ? -1 : n - 1 - idx;
+}
+
+static void mem2reg(Function *fn) {
+    if (takes_scalar_addr(fn))
+        return;
+
+    for (Var *var = fn->locals; var; var = var->next)
+        var->vreg = is_promotable(fn, var) ? new_register(var->ty) : NULL;
+
+    for (IR *ir = fn->irs; ir; ir = ir->next) {
+        if (!ir->lhs || ir->lhs->kind != OP_SYMBOL || !ir->lhs->var->vreg)
+            continue;
+        Operand *vreg = ir->lhs->var->vreg;
+        if (ir->kind == IR_LOAD) {
+            ir->kind = IR_MOV;
+            ir->lhs = vreg;
+        } else if (ir->kind == IR_STORE) {
+            ir->kind = IR_MOV;
+            ir->lhs = ir->rhs;
+            ir->rhs = NULL;
+            ir->dst = vreg;
+        }
+    }
+
+    // Promoted parameters are taken from the argument registers on entry,
+    // before anything can clobber those. They stay in the list of locals
+    // since the backends count them, but get no stack slot; other
+    // promoted locals are dropped from it.
+    Var head = {.next = fn->locals};
+    for (Var *prev = &head; prev->next;) {
+        Var *var = prev->next;
+        if (!var->vreg) {
+            prev = var;
+            continue;
+        }
+        int idx = param_index(fn, var);
+        if (idx != -1) {
+            IR entry = {.next = fn->irs};
+            new_ir(&entry, IR_PARAM, NULL, NULL, var->vreg)->val = idx;
+            fn->irs = entry.next;
+            prev = var;
+            continue;
+        }
+        prev->next = var->next;
+    }
+    fn->locals = head.next;
+}
+
+static int count_uses(Function *fn, Operand *op) {
+    int cnt = 0;
+    for (IR *ir = fn->irs; ir; ir = ir->next) {
+        Operand **uses[MAX_USES(ir)];
+        int nuses = ir_uses(ir, uses);
+        for (int i = 0; i < nuses; i++)
+            if (*uses[i] == op)
+                cnt++;
+    }
+    return cnt;
+}
+
+//
+// Constant folding
+//
+// A register whose only definition is an IR_IMM holds a known constant.
+// Operations on known constants are evaluated at compile time, turning
+// their results into constants in turn, until nothing changes. Branches
+// on constants become plain jumps or vanish.
+//
+
+static int reg_base;
+static int *ndefs;
+static IR **defs;
+
+static void find_defs(Function *fn) {
+    int n = reg_span(fn, &reg_base);
+    ndefs = arena_alloc(&opt_arena, sizeof(int) * n);
+    defs = arena_alloc(&opt_arena, sizeof(IR *) * n);
+    for (IR *ir = fn->irs; ir; ir = ir->next) {
+        Operand **def = ir_def(ir);
+        if (!def)
+            continue;
+        ndefs[(*def)->id - reg_base]++;
+        defs[(*def)->id - reg_base] = ir;
+    }
+}
+
+static bool get_const(Operand *op, long *val) {
+    if (!op || op->kind != OP_REGISTER)
+        return false;
+    IR *def = defs[op->id - reg_base];
+    if (ndefs[op->id - reg_base] != 1 || def->kind != IR_IMM)
+        return false;
+    *val = def->val;
+    return true;
+}
+
+static bool eval(IRKind kind, long l, long r, long *val) {
+    // Wrap around like the target does instead of overflowing in lucc.
+    unsigned long a = l, b = r;
+    switch (kind) {
+    case IR_ADD:
+        *val = a + b;
+        return true;
+    case IR_SUB:
+        *val = a - b;
+        return true;
+    case IR_MUL:
+        *val = a * b;
+        return true;
+    case IR_DIV:
+        if (r == 0 || (l == LONG_MIN && r == -1))
+            return false;
+        *val = l / r;
+        return true;
+    case IR_EQ:
+    case IR_BEQ:
+        *val = l == r;
+        return true;
+    case IR_NE:
+    case IR_BNE:
+        *val = l != r;
+        return true;
+    case IR_LT:
+    case IR_BLT:
+        *val = l < r;
+        return true;
+    case IR_LE:
+    case IR_BLE:
+        *val = l <= r;
+        return true;
+    case IR_BGT:
+        *val = l > r;
+        return true;
+    case IR_BGE:
+        *val = l >= r;
+        return true;
+    }
+    return false;
+}
+
+static void to_imm(IR *ir, long val) {
+    ir->kind = IR_IMM;
+    ir->val = val;
+    ir->lhs = ir->rhs = NULL;
+}
+
+// Returns the value a phi merges if all of its inputs agree.
+static Operand *same_phi_vals(IR *phi) {
+    Operand *val = NULL;
+    for (int i = 0; i < phi->nphi; i++) {
+        if (!phi->phi_vals[i] || phi->phi_vals[i] == phi->dst)
+            continue;
+        if (val && val != phi->phi_vals[i])
+            return NULL;
+        val = phi->phi_vals[i];
+    }
+    return val;
+}
+
+static void fold_constants(Function *fn) {
+    for (bool changed = true; changed;) {
+        changed = false;
+        find_defs(fn);
+
+        IR head = {.next = fn->irs};
+        for (IR *prev = &head; prev->next;) {
+            IR *ir = prev->next;
+            long l, r, val;
+
+            if (ir->kind == IR_MOV && get_const(ir->lhs, &l)) {
+                to_imm(ir, l);
+                changed = true;
+            } else if (ir->kind == IR_PHI && same_phi_vals(ir)) {
+                ir->kind = IR_MOV;
+                ir->lhs = same_phi_vals(ir);
+                ir->nphi = 0;
+                changed = true;
+            } else if (jump_target(ir) && ir->kind != IR_JMP) {
+                bool taken;
+                if (ir->kind == IR_JMPIFZERO && get_const(ir->rhs, &r)) {
+                    taken = (r == 0);
+                } else if (ir->kind == IR_JMPIFNONZERO &&
+                           get_const(ir->rhs, &r)) {
+                    taken = (r != 0);
+                } else if (get_const(ir->lhs, &l) && get_const(ir->rhs, &r) &&
+                           eval(ir->kind, l, r, &val)) {
+                    taken = val;
+                } else {
+                    prev = ir;
+                    continue;
+                }
+                changed = true;
+                if (!taken) {
+                    prev->next = ir->next;
+                    continue;
+                }
+                ir->lhs = jump_target(ir);
+                ir->kind = IR_JMP;
+                ir->rhs = ir->dst = NULL;
+            } else if (get_const(ir->lhs, &l) && get_const(ir->rhs, &r) &&
+                       ir_def(ir) && eval(ir->kind, l, r, &val)) {
+                to_imm(ir, val);
+                changed = true;
+            }
+            prev = ir;
+        }
+        fn->irs = head.next;
+    }
+}
+
+//
+// Copy propagation
+//
+// In SSA form the source of a register copy is available wherever the
+// copy is, so every read of the destination can read the source instead.
+//
+
+static void propagate_copies(Function *fn) {
+    int base;
+    int n = reg_span(fn, &base);
+    Operand **repl = arena_alloc(&opt_arena, sizeof(Operand *) * n);
+    for (IR *ir = fn->irs; ir; ir = ir->next)
+        if (ir->kind == IR_MOV && ir->lhs->kind == OP_REGISTER)
+            repl[ir->dst->id - base] = ir->lhs;
+
+    IR head = {.next = fn->irs};
+    for (IR *prev = &head; prev->next;) {
+        IR *ir = prev->next;
+        Operand **uses[MAX_USES(ir)];
+        int nuses = ir_uses(ir, uses);
+        for (int i = 0; i < nuses; i++)
+            while (repl[(*uses[i])->id - base])
+                *uses[i] = repl[(*uses[i])->id - base];
+        if (ir->kind == IR_MOV && repl[ir->dst->id - base])
+            prev->next = ir->next;
+        else
+            prev = ir;
+    }
+    fn->irs = head.next;
+}
+
+//
+// Dead code elimination
+//
+// Deletes blocks that cannot be reached, jumps to the instruction that
+// follows anyway, and computations whose result nobody needs.
+//
+
+static bool has_side_effect(IR *ir) {
+    switch (ir->kind) {
+    case IR_STORE:
+    case IR_CALL:
+    case IR_TAIL_CALL:
+    case IR_RETURN:
+    case IR_LABEL:
+        return true;
+    }
+    return jump_target(ir);
+}
+
+static void remove_unreachable_blocks(Function *fn) {
+    IR head = {.next = fn->irs};
+    IR *prev = &head;
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        if (bb->rpo == -1)
+            prev->next = bb->last->next;
+        else
+            prev = bb->last;
+    }
+    fn->irs = head.next;
+    build_cfg(fn);
+
+    // Phi inputs from deleted predecessors are gone for good.
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        for (IR *ir = bb->first; ir != bb->last->next; ir = ir->next) {
+            if (ir->kind != IR_PHI)
+                continue;
+            int n = 0;
+            for (int i = 0; i < ir->nphi; i++) {
+                bool found = false;
+                for (int j = 0; j < bb->npreds; j++)
+                    if (bb->preds[j]->first->lhs == ir->phi_labels[i])
+                        found = true;
+                if (!found)
+                    continue;
+                ir->phi_vals[n] = ir->phi_vals[i];
+                ir->phi_labels[n++] = ir->phi_labels[i];
+            }
+            ir->nphi = n;
+        }
+    }
+}
+
+// Whether control reaches label right after ir, with only labels between.
+// Falling through another label turns its block into the predecessor of
+// label's, so that is only done when label starts no phis naming ir's
+// block.
+static bool falls_into(IR *ir, Operand *label) {
+    for (IR *next = ir->next; next && next->kind == IR_LABEL;
+         next = next->next) {
+        if (next->lhs != label)
+            continue;
+        if (next == ir->next)
+            return true;
+        return !next->next || next->next->kind != IR_PHI;
+    }
+    return false;
+}
+
+static void remove_jumps_to_next(Function *fn) {
+    IR head = {.next = fn->irs};
+    for (IR *prev = &head; prev->next;) {
+        IR *ir = prev->next;
+        Operand *target = jump_target(ir);
+        if (target && falls_into(ir, target))
+            prev->next = ir->next;
+        else
+            prev = ir;
+    }
+    fn->irs = head.next;
+}
+
+static bool is_needed(IR *ir, bool *live, int base) {
+    if (ir->kind == IR_NOP)
+        return false;
+    if (has_side_effect(ir))
+        return true;
+    Operand **def = ir_def(ir);
+    return def && live[(*def)->id - base];
+}
+
+static void remove_dead_values(Function *fn) {
+    int base;
+    bool *live = arena_alloc(&opt_arena, sizeof(bool) * reg_span(fn, &base));
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (IR *ir = fn->irs; ir; ir = ir->next) {
+            if (!is_needed(ir, live, base))
+                continue;
+            Operand **uses[MAX_USES(ir)];
+            int nuses = ir_uses(ir, uses);
+            for (int i = 0; i < nuses; i++) {
+                if (!live[(*uses[i])->id - base]) {
+                    live[(*uses[i])->id - base] = true;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    IR head = {.next = fn->irs};
+    for (IR *prev = &head; prev->next;) {
+        IR *ir = prev->next;
+        if (is_needed(ir, live, base))
+            prev = ir;
+        else
+            prev->next = ir->next;
+    }
+    fn->irs = head.next;
+}
+
+static void eliminate_dead_code(Function *fn) {
+    remove_unreachable_blocks(fn);
+    remove_jumps_to_next(fn);
+    remove_dead_values(fn);
+    build_cfg(fn);
+}
+
+//
+// Strength reduction
+//
+// Multiplications by constants become shifts, optionally followed by an
+// add or a subtract, and signed divisions by positive constants become a
+// multiplication by a "magic number" (Hacker's Delight, chapter 10).
+//
+
+static int log2_exact(long val) {
+    if (val <= 0 || (val & (val - 1)))
+        return -1;
+    int k = 0;
+    while ((1L << k) != val)
+        k++;
+    return k;
+}
+
+static IR *new_shift(IR *prev, IRKind kind, Operand *lhs, int k, Type *ty) {
+    IR *ir = new_ir(prev, kind, lhs, NULL, new_register(ty));
+    ir->val = k;
+    return ir;
+}
+
+static void to_shift(IR *ir, IRKind kind, Operand *lhs, int k) {
+    ir->kind = kind;
+    ir->lhs = lhs;
+    ir->rhs = NULL;
+    ir->val = k;
+}
+
+static void reduce_mul(IR *prev, IR *ir) {
+    Operand *x = ir->lhs;
+    long c;
+    if (!get_const(ir->rhs, &c)) {
+        x = ir->rhs;
+        if (!get_const(ir->lhs, &c))
+            return;
+    }
+
+    if (c == 0) {
+        to_imm(ir, 0);
+        return;
+    }
+    if (c == 1) {
+        ir->kind = IR_MOV;
+        ir->lhs = x;
+        ir->rhs = NULL;
+        return;
+    }
+    int k = log2_exact(c);
+    if (k > 0) {
+        to_shift(ir, IR_SHL, x, k);
+        return;
+    }
+
+    // x * (2^k + 1) = (x << k) + x, x * (2^k - 1) = (x << k) - x
+    for (int sign = -1; sign <= 1; sign += 2) {
+        k = log2_exact(c - sign);
+        if (k <= 0)
+            continue;
+        IR *shl = new_shift(prev, IR_SHL, x, k, ir->dst->ty);
+        ir->kind = (sign > 0) ? IR_ADD : IR_SUB;
+        ir->lhs = shl->dst;
+        ir->rhs = x;
+        return;
+    }
+    return;
+}
+
+static void magic_number(long d, long *m, int *s) {
+    unsigned long two63 = 1UL << 63;
+    unsigned long anc = two63 - 1 - two63 % d;
+    unsigned long q1 = two63 / anc, r1 = two63 - q1 * anc;
+    unsigned long q2 = two63 / d, r2 = two63 - q2 * d;
+    unsigned long delta;
+    int p = 63;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= d) {
+            q2++;
+            r2 -= d;
+        }
+        delta = d - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    *m = q2 + 1;
+    *s = p - 64;
+}
+
+static void reduce_div(IR *prev, IR *ir) {
+    long d;
+    if (!get_const(ir->rhs, &d) || d <= 0)
+        return;
+    Operand *n = ir->lhs;
+    Type *ty = ir->dst->ty;
+
+    if (d == 1) {
+        ir->kind = IR_MOV;
+        ir->rhs = NULL;
+        return;
+    }
+
+    // Round towards zero by adding d - 1 to negative dividends.
+    int k = log2_exact(d);
+    if (k > 0) {
+        IR *sign = new_shift(prev, IR_SAR, n, 63, ty);
+        IR *bias = new_shift(sign, IR_SHR, sign->dst, 64 - k, ty);
+        IR *sum = new_ir(bias, IR_ADD, n, bias->dst, new_register(ty));
+        to_shift(ir, IR_SAR, sum->dst, k);
+        return;
+    }
+
+    // q = (mulh(n, m) [+ n]) >> s, plus one if that is negative.
+    long m;
+    int s;
+    magic_number(d, &m, &s);
+    IR *imm = new_ir(prev, IR_IMM, NULL, NULL, new_register(ty));
+    imm->val = m;
+    IR *q = new_ir(imm, IR_MULH, n, imm->dst, new_register(ty));
+    if (m < 0)
+        q = new_ir(q, IR_ADD, q->dst, n, new_register(ty));
+    if (s > 0)
+        q = new_shift(q, IR_SAR, q->dst, s, ty);
+    IR *sign = new_shift(q, IR_SHR, q->dst, 63, ty);
+    ir->kind = IR_ADD;
+    ir->lhs = q->dst;
+    ir->rhs = sign->dst;
+    return;
+}
+
+static void reduce_strength(Function *fn) {
+    find_defs(fn);
+    IR head = {.next = fn->irs};
+    for (IR *prev = &head, *ir = head.next; ir; prev = ir, ir = ir->next) {
+        if (ir->kind == IR_MUL)
+            reduce_mul(prev, ir);
+        else if (ir->kind == IR_DIV)
+            reduce_div(prev, ir);
+    }
+    fn->irs = head.next;
+}
+
+//
+// Loop-invariant code motion
+//
+// A computation inside a loop whose operands are all defined outside of
+// it, or are invariant themselves, yields the same value on every
+// iteration. It moves to a preheader, a new block between the loop's
+// single entering edge and its header. Only instructions that can neither
+// trap nor touch memory move, since the preheader also runs for loops
+// whose body never does. Loops are visited innermost first, so code in a
+// nest can move out one level at a time.
+//
+
+static bool is_hoistable(IR *ir) {
+    switch (ir->kind) {
+    case IR_IMM:
+    case IR_MOV:
+    case IR_ADDR:
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_MULH:
+    case IR_SHL:
+    case IR_SHR:
+    case IR_SAR:
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+        return true;
+    case IR_LOAD:
+        // The "load" of an array only computes its address.
+        return ir->dst->ty->kind == TY_ARRAY;
+    }
+    return false;
+}
+
+static BasicBlock *entering_block(Loop *loop) {
+    BasicBlock *header = loop->header, *pred = NULL;
+    for (int i = 0; i < header->npreds; i++) {
+        if (loop->body[header->preds[i]->id])
+            continue;
+        if (pred)
+            return NULL;
+        pred = header->preds[i];
+    }
+    return pred;
+}
+
+static int *def_bb;      // register id - reg_base -> defining block or -1
+static bool *invariant; // register id - reg_base -> invariant in the loop
+
+static void find_def_blocks(Function *fn) {
+    int n = reg_span(fn, &reg_base);
+    def_bb = arena_alloc(&opt_arena, sizeof(int) * n);
+    for (int v = 0; v < n; v++)
+        def_bb[v] = -1;
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        for (IR *ir = bb->first; ir != bb->last->next; ir = ir->next) {
+            Operand **def = ir_def(ir);
+            if (def)
+                def_bb[(*def)->id - reg_base] = bb->id;
+        }
+    }
+}
+
+static bool defined_outside(Loop *loop, Operand *op) {
+    int v = op->id - reg_base;
+    return def_bb[v] == -1 || !loop->body[def_bb[v]];
+}
+
+// Collects the invariant computations of loop in an order where each one
+// comes after the ones it depends on.
+static int find_invariants(Function *fn, Loop *loop, IR **hoisted) {
+    int nhoisted = 0;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 0; i < fn->nrpo; i++) {
+            BasicBlock *bb = fn->rpo[i];
+            if (!loop->body[bb->id])
+                continue;
+            for (IR *ir = bb->first; ir != bb->last->next; ir = ir->next) {
+                if (!is_hoistable(ir) || invariant[ir->dst->id - reg_base] ||
+                    ndefs[ir->dst->id - reg_base] != 1)
+                    continue;
+                Operand **uses[MAX_USES(ir)];
+                int nuses = ir_uses(ir, uses);
+                bool ok = true;
+                for (int j = 0; j < nuses; j++)
+                    if (!invariant[(*uses[j])->id - reg_base] &&
+                        !defined_outside(loop, *uses[j]))
+                        ok = false;
+                if (!ok)
+                    continue;
+                invariant[ir->dst->id - reg_base] = true;
+                hoisted[nhoisted++] = ir;
+                changed = true;
+            }
+        }
+    }
+
+    // Moving a constant only costs a register across the loop unless a
+    // hoisted computation needs it.
+    int n = reg_span(fn, &reg_base);
+    bool *needed = arena_alloc(&opt_arena, sizeof(bool) * n);
+    for (int i = 0; i < nhoisted; i++) {
+        Operand **uses[MAX_USES(hoisted[i])];
+        int nuses = ir_uses(hoisted[i], uses);
+        for (int j = 0; j < nuses; j++)
+            needed[(*uses[j])->id - reg_base] = true;
+    }
+    int k = 0;
+    for (int i = 0; i < nhoisted; i++) {
+        IR *ir = hoisted[i];
+        if (ir->kind == IR_IMM && !needed[ir->dst->id - reg_base])
+            invariant[ir->dst->id - reg_base] = false;
+        else
+            hoisted[k++] = ir;
+    }
+    return k;
+}
+
+static void retarget(IR *ir, Operand *from, Operand *to) {
+    if (jump_target(ir) != from)
+        return;
+    if (ir->kind == IR_JMP || ir->kind == IR_JMPIFZERO ||
+        ir->kind == IR_JMPIFNONZERO)
+        ir->lhs = to;
+    else
+        ir->dst = to;
+}
+
+// Returns the last IR of a new, empty preheader.
+static IR *insert_preheader(Function *fn, Loop *loop, BasicBlock *pred) {
+    BasicBlock *header = loop->header;
+    Operand *label = header->first->lhs;
+    Operand *pre = new_label("preheader");
+
+    // A loop block laid out right above the header must keep jumping to
+    // it rather than fall into the preheader.
+    BasicBlock *above = fn->bbs;
+    while (above->next != header)
+        above = above->next;
+    IR *cur = above->last;
+    if (loop->body[above->id] && cur->kind != IR_JMP &&
+        cur->kind != IR_RETURN)
+        cur = new_ir(cur, IR_JMP, label, NULL, NULL);
+    cur = new_ir(cur, IR_LABEL, pre, NULL, NULL);
+
+    retarget(pred->last, label, pre);
+    for (IR *ir = header->first; ir != header->last->next; ir = ir->next)
+        for (int i = 0; ir->kind == IR_PHI && i < ir->nphi; i++)
+            if (ir->phi_labels[i] == pred->first->lhs)
+                ir->phi_labels[i] = pre;
+    return cur;
+}
+
+static void hoist_loop(Function *fn, Loop *loop) {
+    BasicBlock *pred = entering_block(loop);
+    if (!pred || pred->first->kind != IR_LABEL ||
+        loop->header->first->kind != IR_LABEL)
+        return;
+
+    find_defs(fn);
+    find_def_blocks(fn);
+    int len = 0;
+    for (IR *ir = fn->irs; ir; ir = ir->next)
+        len++;
+    IR **hoisted = arena_alloc(&opt_arena, sizeof(IR *) * len);
+    invariant = arena_alloc(&opt_arena, sizeof(bool) * reg_span(fn, &reg_base));
+    int nhoisted = find_invariants(fn, loop, hoisted);
+
+    if (nhoisted > 0) {
+        IR head = {.next = fn->irs};
+        for (IR *prev = &head; prev->next;) {
+            IR *ir = prev->next;
+            if (is_hoistable(ir) && invariant[ir->dst->id - reg_base])
+                prev->next = ir->next;
+            else
+                prev = ir;
+        }
+        fn->irs = head.next;
+
+        IR *cur = insert_preheader(fn, loop, pred);
+        for (int i = 0; i < nhoisted; i++) {
+            hoisted[i]->next = cur->next;
+            cur = cur->next = hoisted[i];
+        }
+    }
+}
+
+// Calls visit on every loop of fn, innermost loops first. Since visit may
+// add blocks, the CFG is rebuilt after every loop and the loops already
+// visited are recognized by the labels of their headers.
+static void visit_loops(Function *fn, void (*visit)(Function *, Loop *)) {
+    int nloops = 0;
+    for (Loop *l = fn->loops; l; l = l->next)
+        nloops++;
+
+    IR **done = arena_alloc(&opt_arena, sizeof(IR *) * nloops);
+    for (int ndone = 0; ndone < nloops; ndone++) {
+        Loop *inner = NULL;
+        for (Loop *l = fn->loops; l; l = l->next) {
+            bool seen = false;
+            for (int i = 0; i < ndone; i++)
+                if (done[i] == l->header->first)
+                    seen = true;
+            if (!seen && (!inner || l->depth > inner->depth))
+                inner = l;
+        }
+        if (!inner)
+            break;
+        done[ndone] = inner->header->first;
+        visit(fn, inner);
+        build_cfg(fn);
+    }
+}
+
+//
+// Induction variables
+//
+// A header phi that grows by a constant every iteration is a basic
+// induction variable i. Registers computed from it by scaling with
+// constants and adding invariants are derived ones, j = a * i + b, which
+// typically are the addresses of x[i]. Instead of being recomputed from i
+// on every iteration, a derived variable gets its own phi that starts at
+// a * init + b and grows by a * step. If i is left for nothing but its
+// exit test, the test is rewritten in terms of j, and i dies. A rotated
+// loop tests the incremented i at its bottom; since a is positive, that
+// test becomes one of the incremented j against the same bound.
+//
+
+typedef struct {
+    IR *phi;    // phi of the basic induction variable, NULL if none
+    long scale; // a in a * i + b
+} Induction;
+
+static Induction *ivs; // register id - reg_base -> induction variable
+
+static IR *before_terminator(BasicBlock *bb) {
+    if (!jump_target(bb->last))
+        return bb->last;
+    IR *ir = bb->first;
+    while (ir->next != bb->last)
+        ir = ir->next;
+    return ir;
+}
+
+// Returns the index of the phi input coming from outside of the loop.
+static int entry_index(IR *phi, BasicBlock *pred) {
+    return phi->phi_labels[0] == pred->first->lhs ? 0 : 1;
+}
+
+// Returns the increment of the basic induction variable phi, if it is one.
+static IR *basic_increment(Loop *loop, IR *phi, BasicBlock *pred, long *step) {
+    if (phi->kind != IR_PHI || phi->nphi != 2 ||
+        (phi->phi_labels[0] != pred->first->lhs &&
+         phi->phi_labels[1] != pred->first->lhs))
+        return NULL;
+    Operand *next = phi->phi_vals[1 - entry_index(phi, pred)];
+    if (!next || !phi->phi_vals[entry_index(phi, pred)] ||
+        ndefs[next->id - reg_base] != 1 || defined_outside(loop, next))
+        return NULL;
+
+    IR *inc = defs[next->id - reg_base];
+    if (inc->kind == IR_ADD && inc->rhs == phi->dst &&
+        get_const(inc->lhs, step))
+        return inc;
+    if ((inc->kind == IR_ADD || inc->kind == IR_SUB) &&
+        inc->lhs == phi->dst && get_const(inc->rhs, step)) {
+        if (inc->kind == IR_SUB)
+            *step = -*step;
+        return inc;
+    }
+    return NULL;
+}
+
+static bool is_invariant_in(Loop *loop, Operand *op) {
+    long val;
+    return defined_outside(loop, op) || get_const(op, &val);
+}
+
+// Classifies ir as a derived induction variable if it is one.
+static bool derive(Loop *loop, IR *ir) {
+    Operand **def = ir_def(ir);
+    if (!def || ir->kind == IR_PHI || ndefs[(*def)->id - reg_base] != 1 ||
+        ivs[(*def)->id - reg_base].phi)
+        return false;
+
+    Induction *iv = &ivs[(*def)->id - reg_base];
+    Induction *l = (ir->lhs && ir->lhs->kind == OP_REGISTER)
+                       ? &ivs[ir->lhs->id - reg_base]
+                       : NULL;
+    Induction *r = ir->rhs ? &ivs[ir->rhs->id - reg_base] : NULL;
+    long k;
+
+    switch (ir->kind) {
+    case IR_MOV:
+        if (l)
+            *iv = *l;
+        break;
+    case IR_LOAD:
+        if (l && ir->dst->ty->kind == TY_ARRAY)
+            *iv = *l;
+        break;
+    case IR_ADD:
+        if (l->phi && is_invariant_in(loop, ir->rhs))
+            *iv = *l;
+        else if (r->phi && is_invariant_in(loop, ir->lhs))
+            *iv = *r;
+        break;
+    case IR_SUB:
+        if (l->phi && is_invariant_in(loop, ir->rhs))
+            *iv = *l;
+        break;
+    case IR_MUL:
+        if (l->phi && get_const(ir->rhs, &k)) {
+            *iv = *l;
+            iv->scale *= k;
+        } else if (r->phi && get_const(ir->lhs, &k)) {
+            *iv = *r;
+            iv->scale *= k;
+        }
+        break;
+    case IR_SHL:
+        *iv = *l;
+        iv->scale <<= ir->val;
+        break;
+    }
+    if (iv->phi && iv->scale == 0)
+        iv->phi = NULL;
+    return iv->phi;
+}
+
+// Emits after *cur the computation of op with the basic induction
+// variable replaced by val.
+static Operand *materialize(Loop *loop, Operand *op, IR *phi, Operand *val,
+                            IR **cur) {
+    if (op == phi->dst)
+        op = val;
+    long c;
+    if (!ivs[op->id - reg_base].phi) {
+        if (defined_outside(loop, op) || !get_const(op, &c))
+            return op;
+        *cur = new_ir(*cur, IR_IMM, NULL, NULL, new_register(op->ty));
+        (*cur)->val = c;
+        return (*cur)->dst;
+    }
+
+    IR *def = defs[op->id - reg_base];
+    Operand *lhs = def->lhs, *rhs = def->rhs;
+    if (lhs && lhs->kind == OP_REGISTER)
+        lhs = materialize(loop, lhs, phi, val, cur);
+    if (rhs)
+        rhs = materialize(loop, rhs, phi, val, cur);
+    *cur = new_ir(*cur, def->kind, lhs, rhs, new_register(op->ty));
+    (*cur)->val = def->val;
+    return (*cur)->dst;
+}
+
+// Finds a compare of iv, a basic induction variable or its increment,
+// against an invariant.
+static IR *find_exit_test(Function *fn, Loop *loop, Operand *iv,
+                          Operand **bound) {
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        if (!loop->body[bb->id])
+            continue;
+        for (IR *ir = bb->first; ir != bb->last->next; ir = ir->next) {
+            if (ir->kind != IR_EQ && ir->kind != IR_NE && ir->kind != IR_LT &&
+                ir->kind != IR_LE)
+                continue;
+            if (ir->lhs == iv && is_invariant_in(loop, ir->rhs))
+                *bound = ir->rhs;
+            else if (ir->rhs == iv && is_invariant_in(loop, ir->lhs))
+                *bound = ir->lhs;
+            else
+                continue;
+            return ir;
+        }
+    }
+    return NULL;
+}
+
+static void reduce_ivs(Function *fn, Loop *loop) {
+    BasicBlock *pred = entering_block(loop);
+    if (!pred || pred->nsuccs != 1 || pred->first->kind != IR_LABEL ||
+        loop->header->npreds != 2)
+        return;
+    BasicBlock *header = loop->header;
+    BasicBlock *latch = header->preds[0] == pred ? header->preds[1]
+                                                 : header->preds[0];
+
+    find_defs(fn);
+    find_def_blocks(fn);
+    int n = reg_span(fn, &reg_base);
+    ivs = arena_alloc(&opt_arena, sizeof(Induction) * n);
+
+    long step;
+    for (IR *ir = header->first; ir != header->last->next; ir = ir->next) {
+        if (basic_increment(loop, ir, pred, &step)) {
+            ivs[ir->dst->id - reg_base].phi = ir;
+            ivs[ir->dst->id - reg_base].scale = 1;
+        }
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 0; i < fn->nrpo; i++) {
+            BasicBlock *bb = fn->rpo[i];
+            if (!loop->body[bb->id])
+                continue;
+            for (IR *ir = bb->first; ir != bb->last->next; ir = ir->next)
+                if (derive(loop, ir))
+                    changed = true;
+        }
+    }
+
+    // A derived variable gets its own phi if something else than the
+    // computation of another derived variable reads it.
+    bool *needed = arena_alloc(&opt_arena, sizeof(bool) * n);
+    for (IR *ir = fn->irs; ir; ir = ir->next) {
+        Operand **def = ir_def(ir);
+        if (def && ir->kind != IR_PHI && ivs[(*def)->id - reg_base].phi &&
+            !defined_outside(loop, *def))
+            continue;
+        Operand **uses[MAX_USES(ir)];
+        int nuses = ir_uses(ir, uses);
+        for (int i = 0; i < nuses; i++)
+            needed[(*uses[i])->id - reg_base] = true;
+    }
+
+    IR **reduced = arena_alloc(&opt_arena, sizeof(IR *) * n);
+    int nreduced = 0;
+    for (int i = 0; i < fn->nrpo; i++) {
+        BasicBlock *bb = fn->rpo[i];
+        if (!loop->body[bb->id])
+            continue;
+        for (IR *ir = bb->first; ir != bb->last->next; ir = ir->next) {
+            Operand **def = ir_def(ir);
+            if (!def || ir->kind == IR_PHI || !needed[(*def)->id - reg_base])
+                continue;
+            IR *phi = ivs[(*def)->id - reg_base].phi;
+            if (phi && ivs[(*def)->id - reg_base].scale != 1 &&
+                ir != basic_increment(loop, phi, pred, &step))
+                reduced[nreduced++] = ir;
+        }
+    }
+
+    Operand **phis = arena_alloc(&opt_arena, sizeof(Operand *) * nreduced);
+    Operand **nexts = arena_alloc(&opt_arena, sizeof(Operand *) * nreduced);
+    IR *pre = before_terminator(pred);
+    for (int i = 0; i < nreduced; i++) {
+        Operand *op = reduced[i]->dst;
+        Induction *iv = &ivs[op->id - reg_base];
+        IR *inc = basic_increment(loop, iv->phi, pred, &step);
+        Operand *init = iv->phi->phi_vals[entry_index(iv->phi, pred)];
+        Operand *start = materialize(loop, op, iv->phi, init, &pre);
+
+        phis[i] = new_register(op->ty);
+        IR *imm = new_ir(inc, IR_IMM, NULL, NULL, new_register(ty_int));
+        imm->val = iv->scale * step;
+        IR *next =
+            new_ir(imm, IR_ADD, phis[i], imm->dst, new_register(op->ty));
+        nexts[i] = next->dst;
+
+        IR *phi = new_ir(header->first, IR_PHI, NULL, NULL, phis[i]);
+        phi->nphi = 2;
+        phi->phi_vals = arena_alloc(&ir_arena, sizeof(Operand *) * 2);
+        phi->phi_labels = arena_alloc(&ir_arena, sizeof(Operand *) * 2);
+        phi->phi_vals[0] = start;
+        phi->phi_labels[0] = pred->first->lhs;
+        phi->phi_vals[1] = next->dst;
+        phi->phi_labels[1] = latch->first->lhs;
+    }
+
+    // Compute the bounds of the rewritten exit tests while the derived
+    // variables still have their original definitions. They stay off the
+    // list until it is known whether the tests can be rewritten at all.
+    IR **tests = arena_alloc(&opt_arena, sizeof(IR *) * nreduced);
+    Operand **limits = arena_alloc(&opt_arena, sizeof(Operand *) * nreduced);
+    IR *bounds = arena_alloc(&opt_arena, sizeof(IR) * nreduced);
+    IR **bounds_end = arena_alloc(&opt_arena, sizeof(IR *) * nreduced);
+    for (int i = 0; i < nreduced; i++) {
+        Induction *iv = &ivs[reduced[i]->dst->id - reg_base];
+        bool first = true;
+        for (int j = 0; j < i; j++)
+            if (ivs[reduced[j]->dst->id - reg_base].phi == iv->phi)
+                first = false;
+        Operand *bound;
+        if (!first || iv->scale < 0)
+            continue;
+        IR *inc = basic_increment(loop, iv->phi, pred, &step);
+        tests[i] = find_exit_test(fn, loop, iv->phi->dst, &bound);
+        if (!tests[i])
+            tests[i] = find_exit_test(fn, loop, inc->dst, &bound);
+        bounds_end[i] = &bounds[i];
+        if (tests[i])
+            limits[i] = materialize(loop, reduced[i]->dst, iv->phi, bound,
+                                    &bounds_end[i]);
+    }
+
+    for (int i = 0; i < nreduced; i++) {
+        reduced[i]->kind = IR_MOV;
+        reduced[i]->lhs = phis[i];
+        reduced[i]->rhs = NULL;
+    }
+
+    // Only the increment and the exit test may still read a basic
+    // induction variable for the test to be moved over to a derived one.
+    remove_dead_values(fn);
+    for (int i = 0; i < nreduced; i++) {
+        if (!tests[i])
+            continue;
+        IR *phi = ivs[reduced[i]->dst->id - reg_base].phi;
+        IR *inc = basic_increment(loop, phi, pred, &step);
+        if (count_uses(fn, phi->dst) + count_uses(fn, inc->dst) != 3)
+            continue;
+        bool lhs = tests[i]->lhs == phi->dst || tests[i]->lhs == inc->dst;
+        Operand *iv = lhs ? tests[i]->lhs : tests[i]->rhs;
+        Operand *val = iv == phi->dst ? phis[i] : nexts[i];
+        tests[i]->lhs = lhs ? val : limits[i];
+        tests[i]->rhs = lhs ? limits[i] : val;
+        if (bounds_end[i] != &bounds[i]) {
+            bounds_end[i]->next = pre->next;
+            pre->next = bounds[i].next;
+            pre = bounds_end[i];
+        }
+    }
+
+}
+
+//
+// Branch fusion
+//
+// A compare whose only use is the IR_JMPIFZERO or IR_JMPIFNONZERO right
+// after it becomes a single branch on the inverted or the same condition,
+// so the backends emit one compare and jump instead of materializing a 0/1
+// value first.
+//
+
+static IRKind branch_on(IRKind kind, bool negate) {
+    switch (kind) {
+    case IR_EQ:
+        return negate ? IR_BNE : IR_BEQ;
+    case IR_NE:
+        return negate ? IR_BEQ : IR_BNE;
+    case IR_LT:
+        return negate ? IR_BGE : IR_BLT;
+    case IR_LE:
+        return negate ? IR_BGT : IR_BLE;
+    }
+    return IR_NOP;
+}
+
+static void fuse_branches(Function *fn) {
+    for (IR *ir = fn->irs; ir && ir->next; ir = ir->next) {
+        IR *br = ir->next;
+        if ((br->kind != IR_JMPIFZERO && br->kind != IR_JMPIFNONZERO) ||
+            br->rhs != ir->dst)
+            continue;
+        IRKind kind = branch_on(ir->kind, br->kind == IR_JMPIFZERO);
+        if (kind == IR_NOP || count_uses(fn, ir->dst) != 1)
+            continue;
+        ir->kind = kind;
+        ir->dst = br->lhs;
+        ir->val = br->val;
+        ir->next = br->next;
+    }
+}
+
+//
+// If-conversion
+//
+// A conditional branch around arms that only compute the values of the
+// phis where they join becomes straight-line code: the arms run
+// unconditionally and the phis turn into IR_SELECTs, emitted as cmov or,
+// with -mzicond, as czero. The arms must neither trap nor touch memory.
+// Running both of them costs their IRs plus the selects, which must stay
+// within about half the penalty of a mispredicted branch: that is what an
+// unpredictable branch costs on average. RISC-V without Zicond has no
+// select and keeps its branches.
+//
+
+#define IFCONV_BUDGET 8
+
+static bool has_select(void) {
+    return opt_target == TARGET_X86_64 ||
+           (opt_target == TARGET_RISCV && opt_zicond);
+}
+
+// Extra instructions per select over the branch it replaces: a move and
+// a cmov, or computing the condition, two czero and an or.
+static int select_cost(void) { return opt_target == TARGET_RISCV ? 3 : 2; }
+
+static bool is_cond_branch(IR *ir) {
+    return jump_target(ir) && ir->kind != IR_JMP;
+}
+
+// Returns the cost of running arm unconditionally, or -1 if it cannot.
+static int arm_cost(BasicBlock *arm) {
+    if (arm->npreds != 1 || arm->nsuccs != 1)
+        return -1;
+    int n = 0;
+    for (IR *ir = arm->first->next; ir != arm->last->next; ir = ir->next) {
+        if (ir->kind == IR_JMP)
+            continue;
+        if (!is_hoistable(ir))
+            return -1;
+        n++;
+    }
+    return n;
+}
+
+// Moves the IRs of arm between its label and jump after *pos.
+static void hoist_arm(BasicBlock *arm, IR **pos) {
+    IR *end = arm->last->kind == IR_JMP ? arm->last : arm->last->next;
+    IR *ir = arm->first->next;
+    while (ir != end) {
+        IR *next = ir->next;
+        ir->next = (*pos)->next;
+        (*pos)->next = ir;
+        *pos = ir;
+        ir = next;
+    }
+    arm->first->next = end;
+}
+
+static Operand *phi_val(IR *phi, BasicBlock *pred) {
+    for (int i = 0; i < phi->nphi; i++)
+        if (phi->phi_labels[i] == pred->first->lhs)
+            return phi->phi_vals[i];
+    return NULL;
+}
+
+// Converts the branch ending bb if it forms a triangle, where the
+// fall-through block is the only arm, or a diamond.
+static bool convert_branch(BasicBlock *bb) {
+    // A branch known to go mostly one way is well predicted.
+    IR *br = bb->last;
+    if (!is_cond_branch(br) || bb->nsuccs != 2 || br->val)
+        return false;
+    BasicBlock *taken = bb->succs[0], *fall = bb->succs[1];
+    if (taken == fall || fall->first->kind != IR_LABEL)
+        return false;
+
+    // the arms, NULL for the empty one, and the blocks the join is
+    // entered from on either condition
+    BasicBlock *on_true = NULL, *on_false = fall, *join;
+    BasicBlock *from_true = bb, *from_false = fall;
+    if (fall->nsuccs == 1 && fall->succs[0] == taken) {
+        join = taken;
+    } else {
+        on_true = from_true = taken;
+        join = fall->nsuccs == 1 ? fall->succs[0] : NULL;
+        if (!join || taken->nsuccs != 1 || taken->succs[0] != join ||
+            taken->first->kind != IR_LABEL)
+            return false;
+    }
+    if (join == bb || join->npreds != 2 || join->first->kind != IR_LABEL)
+        return false;
+
+    int cost = arm_cost(on_false);
+    if (cost == -1)
+        return false;
+    if (on_true) {
+        int c = arm_cost(on_true);
+        if (c == -1)
+            return false;
+        cost += c;
+    }
+    for (IR *ir = join->first->next; ir && ir->kind == IR_PHI; ir = ir->next) {
+        if (!phi_val(ir, from_true) && !phi_val(ir, from_false))
+            return false;
+        cost += select_cost();
+    }
+    if (cost > IFCONV_BUDGET)
+        return false;
+
+    IR *pos = before_terminator(bb);
+    if (on_true)
+        hoist_arm(on_true, &pos);
+    hoist_arm(on_false, &pos);
+
+    // IR_JMPIFZERO and IR_JMPIFNONZERO compare their operand with 0.
+    IRKind kind = br->kind;
+    Operand *lhs = br->lhs, *rhs = br->rhs;
+    if (kind == IR_JMPIFZERO || kind == IR_JMPIFNONZERO) {
+        kind = kind == IR_JMPIFZERO ? IR_BEQ : IR_BNE;
+        lhs = br->rhs;
+        pos = new_ir(pos, IR_IMM, NULL, NULL, new_register(lhs->ty));
+        rhs = pos->dst;
+    }
+
+    // The join is now only entered from bb, which defines everything
+    // the selects read.
+    for (IR *ir = join->first->next; ir && ir->kind == IR_PHI; ir = ir->next) {
+        Operand *t = phi_val(ir, from_true), *f = phi_val(ir, from_false);
+        ir->nphi = 0;
+        if (!t || !f || t == f) {
+            ir->kind = IR_MOV;
+            ir->lhs = t ? t : f;
+            continue;
+        }
+        ir->kind = IR_SELECT;
+        ir->lhs = lhs;
+        ir->rhs = rhs;
+        ir->val = kind;
+        ir->nargs = 2;
+        ir->args = arena_alloc(&ir_arena, sizeof(Operand *) * 2);
+        ir->args[0] = t;
+        ir->args[1] = f;
+    }
+
+    br->kind = IR_JMP;
+    br->lhs = join->first->lhs;
+    br->rhs = br->dst = NULL;
+    return true;
+}
+
+static void convert_branches(Function *fn) {
+    if (!has_select())
+        return;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (BasicBlock *bb = fn->bbs; bb && !changed; bb = bb->next)
+            changed = convert_branch(bb);
+        if (changed)
+            eliminate_dead_code(fn);
+    }
+}
+
+//
+// Tail calls
+//
+// A call whose result is returned right away is a tail call. If it calls
+// the function itself, it becomes a jump back to the entry after the new
+// arguments are stored into the parameters, turning the recursion into a
+// loop. Any other tail call becomes an IR_TAIL_CALL, which the backends
+// emit as a jump to the callee after tearing down the frame, so the
+// callee returns directly to our caller.
+//
+// Neither works once the address of a local may have escaped: the callee
+// would read a frame that is gone, or the next round of the loop would
+// overwrite the locals a pointer from the previous one still refers to.
+//
+
+static bool is_tail_call(IR *ir) {
+    return ir->kind == IR_CALL && ir->next && ir->next->kind == IR_RETURN &&
+           ir->next->lhs == ir->dst;
+}
+
+static bool takes_local_addr(Function *fn) {
+    for (Var *v = fn->locals; v; v = v->next)
+        if (v->ty->kind == TY_ARRAY)
+            return true;
+    for (IR *ir = fn->irs; ir; ir = ir->next)
+        if (ir->kind == IR_ADDR && ir->lhs->kind == OP_SYMBOL)
+            return true;
+    return false;
+}
+
+static void eliminate_tail_recursion(Function *fn) {
+    if (takes_local_addr(fn))
+        return;
+
+    int nparams = 0;
+    for (Var *v = fn->params; v; v = v->next)
+        nparams++;
+
+    Operand *entry = new_label("entry");
+    bool found = false;
+    IR head = {.next = fn->irs};
+    for (IR *prev = &head; prev->next; prev = prev->next) {
+        IR *call = prev->next;
+        if (!is_tail_call(call) || strcmp(call->funcname, fn->name) ||
+            call->nargs != nparams)
+            continue;
+        found = true;
+
+        // The arguments are all computed before the call, so storing them
+        // cannot clobber a parameter another argument still needs.
+        IR *cur = prev;
+        int i = nparams;
+        for (Var *v = fn->params; v; v = v->next)
+            cur = new_ir(cur, IR_STORE, new_symbol(v), call->args[--i], NULL);
+        cur = new_ir(cur, IR_JMP, entry, NULL, NULL);
+        cur->next = call->next->next;
+    }
+    if (found)
+        new_ir(&head, IR_LABEL, entry, NULL, NULL);
+    fn->irs = head.next;
+}
+
+static void mark_tail_calls(Function *fn) {
+    if (takes_local_addr(fn))
+        return;
+    for (IR *ir = fn->irs; ir; ir = ir->next) {
+        // Arguments passed on the stack would have to go to our caller's
+        // frame, so only calls fitting in registers on every target jump.
+        if (!is_tail_call(ir) || ir->nargs > 6)
+            continue;
+        ir->kind = IR_TAIL_CALL;
+        ir->dst = NULL;
+        ir->next = ir->next->next;
+    }
+}
+
+//
+// Block layout
+//
+// Blocks are reordered so that a block is followed by its likely
+// successor, which makes the common path fall through and moves cold code
+// out of the way. Frequencies are estimated statically: a loop runs
+// LOOP_TRIPS times, a branch hinted with __builtin_expect goes the
+// expected way nine times out of ten, and so does a branch between
+// staying in a loop and leaving it. Any other branch is a coin flip.
+//
+// Starting from the entry, a chain of blocks grows by the most likely
+// successor not yet placed, as long as that edge is taken at least half
+// of the time. The next chain starts at the first block left in source
+// order, except that cold blocks, which run less often than every other
+// call, are placed last. Leaving the rest in order keeps the live ranges
+// of the register allocator short; for the same reason, only hinted
+// branches steer the chains, as rotated loops already fall through and
+// moving a loop exit out of line would keep its values live across the
+// whole loop. Finally loop headers are aligned.
+//
+
+#define LOOP_TRIPS 8
+#define COLD_FREQ 0.5 // relative to the entry
+#define LOOP_ALIGN 4 // log2 of the alignment of loop headers
+
+// Returns the probability that bb continues to succs[0], the target of
+// its branch, judging from hints alone or from loops as well.
+static double taken_prob(BasicBlock *bb, bool use_loops) {
+    if (bb->nsuccs == 1)
+        return 1;
+    IR *br = bb->last;
+    if (br->val)
+        return br->val > 0 ? 0.9 : 0.1;
+    if (use_loops && bb->loop) {
+        bool in0 = bb->loop->body[bb->succs[0]->id];
+        bool in1 = bb->loop->body[bb->succs[1]->id];
+        if (in0 != in1)
+            return in0 ? 0.9 : 0.1;
+    }
+    return 0.5;
+}
+
+static double edge_prob(BasicBlock *bb, int i, bool use_loops) {
+    double p = taken_prob(bb, use_loops);
+    return i == 0 ? p : 1 - p;
+}
+
+// Blocks are visited in reverse postorder, so every block is done after
+// the predecessors it does not dominate.
+static double *estimate_freqs(Function *fn) {
+    double *freq = arena_alloc(&opt_arena, sizeof(double) * fn->nbbs);
+    freq[fn->bbs->id] = 1;
+    for (int i = 0; i < fn->nrpo; i++) {
+        BasicBlock *bb = fn->rpo[i];
+        for (int j = 0; j < bb->npreds; j++) {
+            BasicBlock *pred = bb->preds[j];
+            if ((j > 0 && bb->preds[j - 1] == pred) || pred->rpo == -1 ||
+                dominates(bb, pred))
+                continue;
+            for (int k = 0; k < pred->nsuccs; k++)
+                if (pred->succs[k] == bb)
+                    freq[bb->id] += freq[pred->id] * edge_prob(pred, k, true);
+        }
+        if (bb->loop && bb->loop->header == bb)
+            freq[bb->id] *= LOOP_TRIPS;
+    }
+    return freq;
+}
+
+// Ties go to the fall-through successor, keeping the original order.
+static BasicBlock *next_in_chain(BasicBlock *bb, bool *placed) {
+    BasicBlock *best = NULL;
+    double best_prob = 0.5;
+    for (int i = bb->nsuccs - 1; i >= 0; i--) {
+        double p = edge_prob(bb, i, false);
+        if (!placed[bb->succs[i]->id] && (p > best_prob || (!best && p == 0.5))) {
+            best = bb->succs[i];
+            best_prob = p;
+        }
+    }
+    return best;
+}
+
+static BasicBlock *next_seed(Function *fn, bool *placed, double *freq) {
+    BasicBlock *best = NULL;
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        if (placed[bb->id])
+            continue;
+        if (freq[bb->id] >= COLD_FREQ)
+            return bb;
+        if (!best || freq[bb->id] > freq[best->id])
+            best = bb;
+    }
+    return best;
+}
+
+static bool falls_through(BasicBlock *bb) {
+    IR *ir = bb->last;
+    return bb->next && ir->kind != IR_JMP && ir->kind != IR_RETURN &&
+           ir->kind != IR_TAIL_CALL;
+}
+
+static Operand *block_label(BasicBlock *bb) {
+    if (bb->first->kind != IR_LABEL) {
+        IR *label = arena_alloc(&ir_arena, sizeof(IR));
+        label->kind = IR_LABEL;
+        label->lhs = new_label("bb");
+        label->next = bb->first;
+        bb->first = label;
+    }
+    return bb->first->lhs;
+}
+
+static IRKind negated_branch(IRKind kind) {
+    switch (kind) {
+    case IR_JMPIFZERO:
+        return IR_JMPIFNONZERO;
+    case IR_JMPIFNONZERO:
+        return IR_JMPIFZERO;
+    case IR_BEQ:
+        return IR_BNE;
+    case IR_BNE:
+        return IR_BEQ;
+    case IR_BLT:
+        return IR_BGE;
+    case IR_BGE:
+        return IR_BLT;
+    case IR_BLE:
+        return IR_BGT;
+    case IR_BGT:
+        return IR_BLE;
+    }
+    error("not a conditional branch");
+}
+
+static void layout_blocks(Function *fn) {
+    if (!fn->bbs)
+        return;
+    double *freq = estimate_freqs(fn);
+    bool *placed = arena_alloc(&opt_arena, sizeof(bool) * fn->nbbs);
+    BasicBlock **order =
+        arena_alloc(&opt_arena, sizeof(BasicBlock *) * fn->nbbs);
+    int n = 0;
+    for (BasicBlock *seed = fn->bbs; seed;
+         seed = next_seed(fn, placed, freq)) {
+        for (BasicBlock *bb = seed; bb; bb = next_in_chain(bb, placed)) {
+            placed[bb->id] = true;
+            order[n++] = bb;
+        }
+    }
+
+    // A block no longer followed by the one it fell into branches there
+    // instead, by inverting its branch if the new neighbor is its target.
+    for (int i = 0; i < n; i++) {
+        BasicBlock *bb = order[i], *next = i + 1 < n ? order[i + 1] : NULL;
+        if (!falls_through(bb) || bb->next == next)
+            continue;
+        Operand *fall = block_label(bb->next);
+        IR *br = bb->last;
+        if (is_cond_branch(br) && next && bb->succs[0] == next) {
+            retarget(br, jump_target(br), fall);
+            br->kind = negated_branch(br->kind);
+            br->val = -br->val;
+        } else {
+            bb->last = new_ir(br, IR_JMP, fall, NULL, NULL);
+        }
+    }
+
+    IR head = {};
+    IR *cur = &head;
+    for (int i = 0; i < n; i++) {
+        cur->next = order[i]->first;
+        cur = order[i]->last;
+    }
+    cur->next = NULL;
+    fn->irs = head.next;
+    remove_jumps_to_next(fn);
+    build_cfg(fn);
+
+    for (Loop *l = fn->loops; l; l = l->next)
+        if (l->header->first->kind == IR_LABEL)
+            l->header->first->val = LOOP_ALIGN;
+}
+
+void optimize(Program *prog) {
+    for (Function *fn = prog->fns; fn; fn = fn->next)
+        eliminate_tail_recursion(fn);
+    inline_functions(prog);
+    arena_release(&opt_arena);
+    for (Function *fn = prog->fns; fn; fn = fn->next) {
+        renumber(fn);
+        mem2reg(fn);
+        build_cfg(fn);
+        to_ssa(fn);
+        renumber(fn);
+        propagate_copies(fn);
+        fold_constants(fn);
+        build_cfg(fn);
+        visit_loops(fn, hoist_loop);
+        visit_loops(fn, reduce_ivs);
+        propagate_copies(fn);
+        build_cfg(fn);
+        reduce_strength(fn);
+        eliminate_dead_code(fn);
+        fuse_branches(fn);
+        build_cfg(fn);
+        convert_branches(fn);
+        mark_tail_calls(fn);
+        build_cfg(fn);
+        from_ssa(fn);
+        layout_blocks(fn);
+        arena_release(&opt_arena);
+    }
+}
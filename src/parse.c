@@ -20,28 +20,32 @@ static Node *postfix(Token **rest, Token *tok);
 static Node *primary(Token **rest, Token *tok);
 static Node *funcall(Token **rest, Token *tok);
 
-bool equal(Token *tok, char *p) {
-    return (strlen(p) == tok->len) && (strncmp(tok->loc, p, tok->len) == 0);
+bool equal(Token *tok, Reserved r) {
+    return tok->kind == TK_RESERVED && tok->id == r;
 }
-Token *skip(Token *tok, char *p) {
-    if (!equal(tok, p))
-        error_tok(tok, "expected token '%s'", p);
-    return tok->next;
+Token *skip(Token *tok, Reserved r) {
+    if (!equal(tok, r))
+        error_tok(tok, "expected token '%s'", reserved_names[r]);
+    return tok + 1;
 }
 
 long get_number(Token *tok) {
     if (tok->kind != TK_NUM)
         error_tok(tok, "number expected");
-    return tok->val;
+    char *p = token_loc(tok);
+    long val = 0;
+    for (int i = 0; i < tok->len; i++)
+        val = val * 10 + (p[i] - '0');
+    return val;
 }
 char *get_ident(Token *tok) {
     if (tok->kind != TK_IDENT)
         error_tok(tok, "identifier expected");
-    return strndup(tok->loc, tok->len);
+    return symbol_name(tok->id);
 }
 
 Node *new_node(NodeKind kind, Token *tok) {
-    Node *node = calloc(1, sizeof(Node));
+    Node *node = arena_alloc(&ast_arena, sizeof(Node));
     node->kind = kind;
     node->tok = tok;
     return node;
@@ -113,16 +117,16 @@ Node *new_var_node(Var *var, Token *tok) {
 }
 
 Var *new_var(char *name, Type *ty) {
-    Var *var = calloc(1, sizeof(Var));
+    Var *var = arena_alloc(&ir_arena, sizeof(Var));
     var->name = name;
     var->ty = ty;
     return var;
 }
 static Var *locals;
+// Names are interned, so they are compared by pointer.
 static Var *find_var(Token *tok) {
     for (Var *var = locals; var; var = var->next) {
-        if (strlen(var->name) == tok->len &&
-            !strncmp(tok->loc, var->name, tok->len))
+        if (var->name == symbol_name(tok->id))
             return var;
     }
     return NULL;
@@ -140,7 +144,7 @@ static Var *new_lvar(char *name, Type *ty) {
 
 // program = funcdef*
 Program *parse(Token *tok) {
-    Program *prog = calloc(1, sizeof(Program));
+    Program *prog = arena_alloc(&ir_arena, sizeof(Program));
     Function head = {};
     Function *cur = &head;
     for (; tok->kind != TK_EOF;) {
@@ -154,7 +158,7 @@ Program *parse(Token *tok) {
 
 // funcdef = type-specifier declarator "{" compound-stmt
 static Function *funcdef(Token **rest, Token *tok) {
-    Function *fn = calloc(1, sizeof(Function));
+    Function *fn = arena_alloc(&ir_arena, sizeof(Function));
     locals = NULL;
     Type *ty = type_specifier(&tok, tok);
     ty = declarator(&tok, tok, ty);
@@ -164,7 +168,7 @@ static Function *funcdef(Token **rest, Token *tok) {
     }
     fn->params = locals;
 
-    tok = skip(tok, "{");
+    tok = skip(tok, P_LBRACE);
     fn->nodes = compound_stmt(&tok, tok);
     fn->locals = locals;
     *rest = tok;
@@ -176,7 +180,7 @@ static Node *compound_stmt(Token **rest, Token *tok) {
     Node *node = new_node(ND_BLOCK, tok);
     Node head = {};
     Node *cur = &head;
-    while (!equal(tok, "}")) {
+    while (!equal(tok, P_RBRACE)) {
         if (is_typename(tok)) {
             cur = cur->next = declaration(&tok, tok);
         } else {
@@ -185,7 +189,7 @@ static Node *compound_stmt(Token **rest, Token *tok) {
     }
     node->body = head.next;
     add_type(node);
-    *rest = skip(tok, "}");
+    *rest = skip(tok, P_RBRACE);
     return node;
 }
 
@@ -199,43 +203,43 @@ static Node *declaration(Token **rest, Token *tok) {
     Node head = {};
     Node *cur = &head;
     int cnt = 0;
-    while (!equal(tok, ";")) {
+    while (!equal(tok, P_SEMICOLON)) {
         if (cnt++ > 0)
-            tok = skip(tok, ",");
+            tok = skip(tok, P_COMMA);
 
         Type *ty = declarator(&tok, tok, basety);
         Var *var = new_lvar(get_ident(ty->name), ty);
         // initializer
-        if (!equal(tok, "="))
+        if (!equal(tok, P_ASSIGN))
             continue;
 
         Node *lhs = new_var_node(var, ty->name);
-        Node *rhs = expr(&tok, tok->next);
+        Node *rhs = expr(&tok, tok + 1);
         Node *node = new_binary(ND_ASSIGN, lhs, rhs, tok);
         cur = cur->next = new_unary(ND_EXPR_STMT, node, tok);
     }
 
     Node *node = new_node(ND_BLOCK, tok);
     node->body = head.next;
-    *rest = skip(tok, ";");
+    *rest = skip(tok, P_SEMICOLON);
     return node;
 }
 
 // type-specifier = "int"
 static Type *type_specifier(Token **rest, Token *tok) {
-    *rest = skip(tok, "int");
+    *rest = skip(tok, KW_INT);
     return ty_int;
 }
 // declarator = ("*")* ident type-suffix?
 static Type *declarator(Token **rest, Token *tok, Type *ty) {
-    for (; equal(tok, "*"); tok = tok->next) {
+    for (; equal(tok, P_MUL); tok++) {
         ty = pointer_to(ty);
     }
     if (tok->kind != TK_IDENT) {
         error_tok(tok, "expected variable name");
     }
 
-    ty = type_suffix(rest, tok->next, ty);
+    ty = type_suffix(rest, tok + 1, ty);
     ty->name = tok;
     return ty;
 }
@@ -243,12 +247,12 @@ static Type *declarator(Token **rest, Token *tok, Type *ty) {
 // type-suffix = ("(" func-params | "[" array-dim)?
 // array-dim = num "]" type-suffix
 static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
-    if (equal(tok, "(")) {
-        return func_params(rest, tok->next, ty);
+    if (equal(tok, P_LPAREN)) {
+        return func_params(rest, tok + 1, ty);
     }
-    if (equal(tok, "[")) {
-        int sz = get_number(tok->next);
-        tok = skip(tok->next->next, "]");
+    if (equal(tok, P_LBRACKET)) {
+        int sz = get_number(tok + 1);
+        tok = skip(tok + 2, P_RBRACKET);
         *rest = tok;
         ty = type_suffix(rest, tok, ty);
         return array_of(ty, sz);
@@ -263,16 +267,16 @@ static Type *func_params(Token **rest, Token *tok, Type *ty) {
     Type head = {};
     Type *cur = &head;
     int cnt = 0;
-    while (!equal(tok, ")")) {
+    while (!equal(tok, P_RPAREN)) {
         if (cnt++ > 0)
-            tok = skip(tok, ",");
+            tok = skip(tok, P_COMMA);
         Type *basety = type_specifier(&tok, tok);
         Type *ty = declarator(&tok, tok, basety);
         cur = cur->next = copy_type(ty);
     }
     ty = func_type(ty);
     ty->params = head.next;
-    *rest = skip(tok, ")");
+    *rest = skip(tok, P_RPAREN);
     return ty;
 }
 
@@ -283,56 +287,56 @@ static Type *func_params(Token **rest, Token *tok, Type *ty) {
 //      | "for" "(" expr? ";" expr? ";" expr? ")" stmt
 //      | "{" compound-stmt
 static Node *stmt(Token **rest, Token *tok) {
-    if (equal(tok, "{")) {
-        return compound_stmt(rest, tok->next);
+    if (equal(tok, P_LBRACE)) {
+        return compound_stmt(rest, tok + 1);
     }
-    if (equal(tok, "if")) {
+    if (equal(tok, KW_IF)) {
         Node *node = new_node(ND_IF, tok);
-        tok = skip(tok->next, "(");
+        tok = skip(tok + 1, P_LPAREN);
         node->cond = expr(&tok, tok);
-        tok = skip(tok, ")");
+        tok = skip(tok, P_RPAREN);
         node->then = stmt(&tok, tok);
-        if (equal(tok, "else"))
-            node->els = stmt(&tok, tok->next);
+        if (equal(tok, KW_ELSE))
+            node->els = stmt(&tok, tok + 1);
         *rest = tok;
         return node;
     }
-    if (equal(tok, "for")) {
+    if (equal(tok, KW_FOR)) {
         Node *node = new_node(ND_FOR, tok);
-        tok = skip(tok->next, "(");
-        if (!equal(tok, ";"))
+        tok = skip(tok + 1, P_LPAREN);
+        if (!equal(tok, P_SEMICOLON))
             node->init = expr_stmt(&tok, tok);
-        tok = skip(tok, ";");
+        tok = skip(tok, P_SEMICOLON);
 
-        if (!equal(tok, ";"))
+        if (!equal(tok, P_SEMICOLON))
             node->cond = expr(&tok, tok);
-        tok = skip(tok, ";");
+        tok = skip(tok, P_SEMICOLON);
 
-        if (!equal(tok, ")"))
+        if (!equal(tok, P_RPAREN))
             node->inc = expr_stmt(&tok, tok);
-        tok = skip(tok, ")");
+        tok = skip(tok, P_RPAREN);
 
         node->then = stmt(&tok, tok);
         *rest = tok;
         return node;
     }
-    if (equal(tok, "while")) {
+    if (equal(tok, KW_WHILE)) {
         Node *node = new_node(ND_FOR, tok);
-        tok = skip(tok->next, "(");
+        tok = skip(tok + 1, P_LPAREN);
         node->cond = expr(&tok, tok);
-        tok = skip(tok, ")");
+        tok = skip(tok, P_RPAREN);
         node->then = stmt(&tok, tok);
         *rest = tok;
         return node;
     }
 
-    if (equal(tok, "return")) {
-        Node *node = new_unary(ND_RETURN, expr(&tok, tok->next), tok);
-        *rest = skip(tok, ";");
+    if (equal(tok, KW_RETURN)) {
+        Node *node = new_unary(ND_RETURN, expr(&tok, tok + 1), tok);
+        *rest = skip(tok, P_SEMICOLON);
         return node;
     }
     Node *node = expr_stmt(&tok, tok);
-    *rest = skip(tok, ";");
+    *rest = skip(tok, P_SEMICOLON);
     return node;
 }
 
@@ -346,9 +350,9 @@ static Node *expr(Token **rest, Token *tok) { return assign(rest, tok); }
 // assign = equality ("=" assign)?
 static Node *assign(Token **rest, Token *tok) {
     Node *node = equality(&tok, tok);
-    if (equal(tok, "=")) {
+    if (equal(tok, P_ASSIGN)) {
         Token *op = tok;
-        node = new_binary(ND_ASSIGN, node, assign(&tok, tok->next), op);
+        node = new_binary(ND_ASSIGN, node, assign(&tok, tok + 1), op);
     }
     *rest = tok;
     return node;
@@ -359,13 +363,13 @@ static Node *equality(Token **rest, Token *tok) {
     Node *node = relational(&tok, tok);
     for (;;) {
         Token *op = tok;
-        if (equal(tok, "==")) {
-            Node *rhs = relational(&tok, tok->next);
+        if (equal(tok, P_EQ)) {
+            Node *rhs = relational(&tok, tok + 1);
             node = new_binary(ND_EQ, node, rhs, op);
             continue;
         }
-        if (equal(tok, "!=")) {
-            Node *rhs = relational(&tok, tok->next);
+        if (equal(tok, P_NE)) {
+            Node *rhs = relational(&tok, tok + 1);
             node = new_binary(ND_NE, node, rhs, op);
             continue;
         }
@@ -378,23 +382,23 @@ static Node *relational(Token **rest, Token *tok) {
     Node *node = add(&tok, tok);
     for (;;) {
         Token *op = tok;
-        if (equal(tok, "<")) {
-            Node *rhs = add(&tok, tok->next);
+        if (equal(tok, P_LT)) {
+            Node *rhs = add(&tok, tok + 1);
             node = new_binary(ND_LT, node, rhs, op);
             continue;
         }
-        if (equal(tok, "<=")) {
-            Node *rhs = add(&tok, tok->next);
+        if (equal(tok, P_LE)) {
+            Node *rhs = add(&tok, tok + 1);
             node = new_binary(ND_LE, node, rhs, op);
             continue;
         }
-        if (equal(tok, ">")) {
-            Node *rhs = add(&tok, tok->next);
+        if (equal(tok, P_GT)) {
+            Node *rhs = add(&tok, tok + 1);
             node = new_binary(ND_LT, rhs, node, op);
             continue;
         }
-        if (equal(tok, ">=")) {
-            Node *rhs = add(&tok, tok->next);
+        if (equal(tok, P_GE)) {
+            Node *rhs = add(&tok, tok + 1);
             node = new_binary(ND_LE, rhs, node, op);
             continue;
         }
@@ -408,13 +412,13 @@ static Node *add(Token **rest, Token *tok) {
     Node *node = mul(&tok, tok);
     for (;;) {
         Token *op = tok;
-        if (equal(tok, "+")) {
-            Node *rhs = mul(&tok, tok->next);
+        if (equal(tok, P_ADD)) {
+            Node *rhs = mul(&tok, tok + 1);
             node = new_add(node, rhs, op);
             continue;
         }
-        if (equal(tok, "-")) {
-            Node *rhs = mul(&tok, tok->next);
+        if (equal(tok, P_SUB)) {
+            Node *rhs = mul(&tok, tok + 1);
             node = new_sub(node, rhs, op);
             continue;
         }
@@ -427,13 +431,13 @@ static Node *mul(Token **rest, Token *tok) {
     Node *node = unary(&tok, tok);
     for (;;) {
         Token *op = tok;
-        if (equal(tok, "*")) {
-            Node *rhs = unary(&tok, tok->next);
+        if (equal(tok, P_MUL)) {
+            Node *rhs = unary(&tok, tok + 1);
             node = new_binary(ND_MUL, node, rhs, op);
             continue;
         }
-        if (equal(tok, "/")) {
-            Node *rhs = unary(&tok, tok->next);
+        if (equal(tok, P_DIV)) {
+            Node *rhs = unary(&tok, tok + 1);
             node = new_binary(ND_DIV, node, rhs, op);
             continue;
         }
@@ -448,23 +452,23 @@ static Node *mul(Token **rest, Token *tok) {
 // unary-op = "+" | "-" | "*" | "&"
 static Node *unary(Token **rest, Token *tok) {
     Token *start = tok;
-    if (equal(tok, "sizeof")) {
-        Node *node = unary(rest, tok->next);
+    if (equal(tok, KW_SIZEOF)) {
+        Node *node = unary(rest, tok + 1);
         add_type(node);
         return new_number(size_of(node->ty), start);
     }
-    if (equal(tok, "+")) {
-        return unary(rest, tok->next);
+    if (equal(tok, P_ADD)) {
+        return unary(rest, tok + 1);
     }
-    if (equal(tok, "-")) {
-        return new_binary(ND_SUB, new_number(0, tok), unary(rest, tok->next),
+    if (equal(tok, P_SUB)) {
+        return new_binary(ND_SUB, new_number(0, tok), unary(rest, tok + 1),
                           start);
     }
-    if (equal(tok, "*")) {
-        return new_unary(ND_DEREF, unary(rest, tok->next), start);
+    if (equal(tok, P_MUL)) {
+        return new_unary(ND_DEREF, unary(rest, tok + 1), start);
     }
-    if (equal(tok, "&")) {
-        return new_unary(ND_ADDR, unary(rest, tok->next), start);
+    if (equal(tok, P_AMP)) {
+        return new_unary(ND_ADDR, unary(rest, tok + 1), start);
     }
     return postfix(rest, tok);
 }
@@ -473,12 +477,12 @@ static Node *unary(Token **rest, Token *tok) {
 // postfix-op = "[" expr "]"
 static Node *postfix(Token **rest, Token *tok) {
     Node *node = primary(&tok, tok);
-    while (equal(tok, "[")) {
+    while (equal(tok, P_LBRACKET)) {
         Token *op = tok;
-        Node *ex = expr(&tok, tok->next);
+        Node *ex = expr(&tok, tok + 1);
         node = new_add(node, ex, op);
         node = new_unary(ND_DEREF, node, op);
-        tok = skip(tok, "]");
+        tok = skip(tok, P_RBRACKET);
     }
     *rest = tok;
     return node;
@@ -486,13 +490,13 @@ static Node *postfix(Token **rest, Token *tok) {
 
 // primary = num | ident | funcall | "(" expr ")"
 static Node *primary(Token **rest, Token *tok) {
-    if (equal(tok, "(")) {
-        Node *node = expr(&tok, tok->next);
-        *rest = skip(tok, ")");
+    if (equal(tok, P_LPAREN)) {
+        Node *node = expr(&tok, tok + 1);
+        *rest = skip(tok, P_RPAREN);
         return node;
     }
     if (tok->kind == TK_IDENT) {
-        if (equal(tok->next, "(")) {
+        if (equal(tok + 1, P_LPAREN)) {
             return funcall(rest, tok);
         }
         Node *node = new_node(ND_VAR, tok);
@@ -502,11 +506,11 @@ static Node *primary(Token **rest, Token *tok) {
         } else {
             error_tok(tok, "undeclared identifier: %s", get_ident(tok));
         }
-        *rest = tok->next;
+        *rest = tok + 1;
         return node;
     }
     Node *node = new_number(get_number(tok), tok);
-    *rest = tok->next;
+    *rest = tok + 1;
     return node;
 }
 
@@ -514,20 +518,20 @@ static Node *primary(Token **rest, Token *tok) {
 static Node *funcall(Token **rest, Token *tok) {
     Node *node = new_node(ND_FUNCALL, tok);
     node->funcname = get_ident(tok);
-    tok = skip(tok->next, "(");
+    tok = skip(tok + 1, P_LPAREN);
 
     Node head = {};
     Node *cur = &head;
     int nargs = 0;
-    while (!equal(tok, ")")) {
+    while (!equal(tok, P_RPAREN)) {
         if (nargs)
-            tok = skip(tok, ",");
+            tok = skip(tok, P_COMMA);
         cur = cur->next = assign(&tok, tok);
         nargs++;
     }
     cur->next = NULL;
     node->args = head.next;
     node->nargs = nargs;
-    *rest = skip(tok, ")");
+    *rest = skip(tok, P_RPAREN);
     return node;
 }
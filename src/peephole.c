@@ -0,0 +1,223 @@
+#include "lucc.h"
+
+// Machine instructions and the peephole optimizer.
+//
+// The backends do not print assembly right away: emitfln() parses each
+// line into an Inst, a mnemonic plus its operands as text, and appends it
+// to a list. Labels and directives are kept as lines.
+//
+// peephole() then rewrites the list with a target's table of rules. A rule
+// is a short sequence of consecutive instructions written like assembly
+// and the sequence replacing it. An operand consisting of a single capital
+// letter is a placeholder: R and S match registers, M matches memory
+// operands and any other letter matches anything. A placeholder appearing
+// twice must match the same text both times. A pattern line "L:" matches a
+// label. Rewriting repeats until no rule applies anymore, and every rule
+// counts how often it did.
+
+static Inst head;
+static Inst *tail = &head;
+
+static Inst *new_inst(char *op) {
+    Inst *inst = arena_alloc(&codegen_arena, sizeof(Inst));
+    inst->op = op;
+    return inst;
+}
+
+// Splits "op a, b" at the commas outside parentheses.
+static Inst *parse_inst(char *line) {
+    if (line[0] != '\t') {
+        Inst *inst = new_inst(NULL);
+        inst->line = line;
+        return inst;
+    }
+
+    char *p = line + 1;
+    Inst *inst = new_inst(arena_strndup(&codegen_arena, p, strcspn(p, " ")));
+    p += strlen(inst->op);
+    if (*p == '\0')
+        return inst;
+
+    p++;
+    for (;;) {
+        if (inst->nargs == INST_MAX_ARGS)
+            error("too many operands: %s", line);
+        char *start = p;
+        int depth = 0;
+        for (; *p && !(depth == 0 && *p == ','); p++) {
+            if (*p == '(')
+                depth++;
+            if (*p == ')')
+                depth--;
+        }
+        inst->args[inst->nargs++] =
+            arena_strndup(&codegen_arena, start, p - start);
+        if (*p == '\0')
+            return inst;
+        p += 2;
+    }
+}
+
+void emitfln(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char *line = arena_vprintf(&codegen_arena, fmt, ap);
+    va_end(ap);
+    tail = tail->next = parse_inst(line);
+}
+
+static void print_inst(Inst *inst) {
+    if (!inst->op) {
+        fprintf(outfile, "%s\n", inst->line);
+        return;
+    }
+    fprintf(outfile, "\t%s", inst->op);
+    for (int i = 0; i < inst->nargs; i++)
+        fprintf(outfile, "%s%s", i ? ", " : " ", inst->args[i]);
+    fprintf(outfile, "\n");
+}
+
+// Writes out the instructions, which releases their memory.
+void flush_insts(void) {
+    for (Inst *inst = head.next; inst; inst = inst->next)
+        print_inst(inst);
+    head.next = NULL;
+    tail = &head;
+    arena_release(&codegen_arena);
+}
+
+//
+// Matching
+//
+
+// the text bound to each placeholder, by letter
+static char *bound[26];
+
+static bool is_placeholder(char *s) {
+    return 'A' <= s[0] && s[0] <= 'Z' && s[1] == '\0';
+}
+
+static bool is_label(Inst *inst) {
+    if (inst->op)
+        return false;
+    int len = strlen(inst->line);
+    return len > 0 && inst->line[len - 1] == ':' && inst->line[0] != '\t';
+}
+
+static bool is_memory(char *s) { return strchr(s, '(') != NULL; }
+
+static bool is_register(char *s) {
+    return (s[0] == '%' || isalpha(s[0])) && !is_memory(s);
+}
+
+static bool bind(char *pat, char *text) {
+    if (!is_placeholder(pat))
+        return !strcmp(pat, text);
+    char c = pat[0];
+    if ((c == 'R' || c == 'S') && !is_register(text))
+        return false;
+    if (c == 'M' && !is_memory(text))
+        return false;
+    if (bound[c - 'A'])
+        return !strcmp(bound[c - 'A'], text);
+    bound[c - 'A'] = text;
+    return true;
+}
+
+static bool match_inst(Inst *pat, Inst *inst) {
+    if (!pat->op) {
+        if (!is_label(inst))
+            return false;
+        char *name = arena_strndup(&codegen_arena, inst->line,
+                                   strlen(inst->line) - 1);
+        return bind(arena_strndup(&codegen_arena, pat->line,
+                                  strlen(pat->line) - 1),
+                    name);
+    }
+    if (!inst->op || strcmp(pat->op, inst->op) || pat->nargs != inst->nargs)
+        return false;
+    for (int i = 0; i < pat->nargs; i++)
+        if (!bind(pat->args[i], inst->args[i]))
+            return false;
+    return true;
+}
+
+// Parses the lines of a pattern or replacement. A pattern line without a
+// leading tab is a label.
+static Inst **parse_lines(char **lines, int *n) {
+    Inst **insts = arena_alloc(&codegen_arena, sizeof(Inst *) * PEEP_WINDOW);
+    for (*n = 0; *n < PEEP_WINDOW && lines[*n]; (*n)++) {
+        char *line = lines[*n];
+        bool label = line[strlen(line) - 1] == ':';
+        insts[*n] = parse_inst(
+            arena_printf(&codegen_arena, "%s%s", label ? "" : "\t", line));
+    }
+    return insts;
+}
+
+static char *subst(char *text) {
+    return is_placeholder(text) ? bound[text[0] - 'A'] : text;
+}
+
+static Inst *instantiate(Inst *tmpl) {
+    Inst *inst = new_inst(tmpl->op);
+    if (!tmpl->op) {
+        char *name = subst(arena_strndup(&codegen_arena, tmpl->line,
+                                         strlen(tmpl->line) - 1));
+        inst->line = arena_printf(&codegen_arena, "%s:", name);
+        return inst;
+    }
+    inst->nargs = tmpl->nargs;
+    for (int i = 0; i < tmpl->nargs; i++)
+        inst->args[i] = subst(tmpl->args[i]);
+    return inst;
+}
+
+// Replaces the instructions after prev if rule matches them.
+static bool apply(PeepRule *rule, Inst **pat, int npat, Inst **repl, int nrepl,
+                  Inst *prev) {
+    memset(bound, 0, sizeof(bound));
+    Inst *inst = prev->next;
+    for (int i = 0; i < npat; i++, inst = inst->next)
+        if (!inst || !match_inst(pat[i], inst))
+            return false;
+
+    Inst *cur = prev;
+    for (int i = 0; i < nrepl; i++)
+        cur = cur->next = instantiate(repl[i]);
+    cur->next = inst;
+    rule->hits++;
+    return true;
+}
+
+void peephole(PeepRule *rules, int nrules) {
+    Inst ***pats = arena_alloc(&codegen_arena, sizeof(Inst **) * nrules);
+    Inst ***repls = arena_alloc(&codegen_arena, sizeof(Inst **) * nrules);
+    int *npats = arena_alloc(&codegen_arena, sizeof(int) * nrules);
+    int *nrepls = arena_alloc(&codegen_arena, sizeof(int) * nrules);
+    for (int i = 0; i < nrules; i++) {
+        pats[i] = parse_lines(rules[i].pat, &npats[i]);
+        repls[i] = parse_lines(rules[i].repl, &nrepls[i]);
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (Inst *prev = &head; prev->next;) {
+            bool hit = false;
+            for (int i = 0; i < nrules && !hit; i++)
+                hit = apply(&rules[i], pats[i], npats[i], repls[i], nrepls[i],
+                            prev);
+            if (hit)
+                changed = true;
+            else
+                prev = prev->next;
+        }
+    }
+    for (tail = &head; tail->next; tail = tail->next)
+        ;
+}
+
+void print_peephole_stats(PeepRule *rules, int nrules) {
+    for (int i = 0; i < nrules; i++)
+        fprintf(stderr, "peephole %s: %d\n", rules[i].name, rules[i].hits);
+}
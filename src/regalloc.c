@@ -0,0 +1,367 @@
+#include "lucc.h"
+
+// Linear-scan register allocator shared by the backends.
+//
+// Every OP_REGISTER operand is a virtual register. Its live interval is
+// computed over a linear numbering of the IR list, with liveness solved on
+// basic blocks so that values flowing around a loop stay live for the whole
+// loop. Intervals are then assigned target registers in order of their
+// start; when the target runs out, the interval ending last is spilled to a
+// stack slot and its uses and definitions are rewritten to go through the
+// target's scratch registers, of which the backends provide one for every
+// register an instruction can read. Call arguments are the exception:
+// there may be more of them than scratch registers, so the backends move
+// spilled ones from their slots into the argument registers directly.
+// Spilled intervals that do not overlap share a slot.
+//
+// A constant live across a call is not worth a callee-saved register or a
+// slot: it is rematerialized, that is, loaded afresh right before each of
+// its uses, and the original definition goes away.
+//
+// Instruction i reads its lhs at 2i, reads its rhs at 2i+1 and writes its
+// dst at 2i+1. Thus dst may reuse the register of an lhs dying at i but
+// never the one of rhs, which lets two-address targets emit
+// "mov lhs, dst; op rhs, dst". The registers of an address in rhs count as
+// rhs.
+//
+// The backends learn which registers need saving from two bit sets over
+// the pool passed in, bit i standing for regs[i]: fn->used_regs holds the
+// registers assigned anywhere in the function, and the live_regs of a call
+// those holding a value that is still needed after it.
+
+// Per-block liveness sets, indexed by block id and then by register.
+typedef struct {
+    int from, to;
+    bool *use, *def, *in, *out;
+} Liveness;
+
+typedef struct {
+    Operand *op;
+    int start, end;
+} Interval;
+
+static int min_id, nvregs;
+
+static int vreg(Operand *op) { return op->id - min_id; }
+
+static Liveness *compute_liveness(Function *fn) {
+    Liveness *live = arena_alloc(&codegen_arena, sizeof(Liveness) * fn->nbbs);
+    int pos = 0;
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        Liveness *lv = &live[bb->id];
+        lv->use = arena_alloc(&codegen_arena, nvregs);
+        lv->def = arena_alloc(&codegen_arena, nvregs);
+        lv->in = arena_alloc(&codegen_arena, nvregs);
+        lv->out = arena_alloc(&codegen_arena, nvregs);
+        lv->from = 2 * pos;
+        for (IR *ir = bb->first;; ir = ir->next, pos++) {
+            Operand **uses[MAX_USES(ir)];
+            int nuses = ir_uses(ir, uses);
+            for (int j = 0; j < nuses; j++)
+                if (!lv->def[vreg(*uses[j])])
+                    lv->use[vreg(*uses[j])] = true;
+            Operand **def = ir_def(ir);
+            if (def)
+                lv->def[vreg(*def)] = true;
+            if (ir == bb->last)
+                break;
+        }
+        lv->to = 2 * pos++ + 1;
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = fn->nrpo - 1; i >= 0; i--) {
+            BasicBlock *bb = fn->rpo[i];
+            Liveness *lv = &live[bb->id];
+            for (int v = 0; v < nvregs; v++) {
+                bool out = false;
+                for (int j = 0; j < bb->nsuccs; j++)
+                    if (live[bb->succs[j]->id].in[v])
+                        out = true;
+                bool in = lv->use[v] || (out && !lv->def[v]);
+                if (out != lv->out[v] || in != lv->in[v])
+                    changed = true;
+                lv->out[v] = out;
+                lv->in[v] = in;
+            }
+        }
+    }
+    return live;
+}
+
+static bool reads_late(IR *ir, Operand **use) {
+    Operand *rhs = ir->rhs;
+    return use == &ir->rhs || (rhs && rhs->kind == OP_ADDRESS &&
+                               (use == &rhs->base || use == &rhs->index));
+}
+
+static void extend(Interval *it, int pos) {
+    if (pos < it->start)
+        it->start = pos;
+    if (pos > it->end)
+        it->end = pos;
+}
+
+static Interval *build_intervals(Function *fn, Liveness *live) {
+    Interval *intervals =
+        arena_alloc(&codegen_arena, sizeof(Interval) * nvregs);
+    for (int v = 0; v < nvregs; v++) {
+        intervals[v].start = 1 << 30;
+        intervals[v].end = -1;
+    }
+
+    int pos = 0;
+    for (IR *ir = fn->irs; ir; ir = ir->next, pos++) {
+        Operand **uses[MAX_USES(ir)];
+        int nuses = ir_uses(ir, uses);
+        for (int j = 0; j < nuses; j++) {
+            Interval *it = &intervals[vreg(*uses[j])];
+            it->op = *uses[j];
+            extend(it, reads_late(ir, uses[j]) ? 2 * pos + 1 : 2 * pos);
+        }
+        Operand **def = ir_def(ir);
+        if (def) {
+            Interval *it = &intervals[vreg(*def)];
+            it->op = *def;
+            extend(it, 2 * pos + 1);
+        }
+    }
+
+    for (int i = 0; i < fn->nbbs; i++) {
+        for (int v = 0; v < nvregs; v++) {
+            if (live[i].in[v])
+                extend(&intervals[v], live[i].from);
+            if (live[i].out[v])
+                extend(&intervals[v], live[i].to);
+        }
+    }
+    return intervals;
+}
+
+static int cmp_start(const void *a, const void *b) {
+    return (*(Interval **)a)->start - (*(Interval **)b)->start;
+}
+
+static void spill(Function *fn, Interval *it) {
+    it->op->reg = NULL;
+    fn->nspills++;
+}
+
+static void linear_scan(Function *fn, Interval *intervals, Register **regs,
+                        int nregs) {
+    Interval **sorted =
+        arena_alloc(&codegen_arena, sizeof(Interval *) * nvregs);
+    int n = 0;
+    for (int v = 0; v < nvregs; v++)
+        if (intervals[v].op)
+            sorted[n++] = &intervals[v];
+    qsort(sorted, n, sizeof(Interval *), cmp_start);
+
+    for (int i = 0; i < nregs; i++)
+        regs[i]->used = false;
+
+    // active intervals, sorted by increasing end
+    Interval **active = arena_alloc(&codegen_arena, sizeof(Interval *) * nregs);
+    int nactive = 0;
+
+    for (int i = 0; i < n; i++) {
+        Interval *cur = sorted[i];
+
+        int j = 0;
+        for (; j < nactive && active[j]->end < cur->start; j++)
+            active[j]->op->reg->used = false;
+        memmove(active, active + j, (nactive - j) * sizeof(Interval *));
+        nactive -= j;
+
+        if (nactive == nregs) {
+            Interval *last = active[nactive - 1];
+            if (last->end <= cur->end) {
+                spill(fn, cur);
+                continue;
+            }
+            cur->op->reg = last->op->reg;
+            spill(fn, last);
+            nactive--;
+        } else {
+            for (int k = 0; k < nregs; k++) {
+                if (regs[k]->used)
+                    continue;
+                regs[k]->used = true;
+                cur->op->reg = regs[k];
+                break;
+            }
+        }
+
+        int k = nactive++;
+        for (; k > 0 && active[k - 1]->end > cur->end; k--)
+            active[k] = active[k - 1];
+        active[k] = cur;
+    }
+}
+
+static int pool_index(Register *reg, Register **regs, int nregs) {
+    for (int i = 0; i < nregs; i++)
+        if (regs[i] == reg)
+            return i;
+    error("register not in pool: %s", reg->name);
+}
+
+static void record_used_regs(Function *fn, Interval *intervals,
+                             Register **regs, int nregs) {
+    fn->used_regs = 0;
+    for (int v = 0; v < nvregs; v++)
+        if (intervals[v].op && intervals[v].op->reg)
+            fn->used_regs |= 1u << pool_index(intervals[v].op->reg, regs, nregs);
+
+    int pos = 0;
+    for (IR *ir = fn->irs; ir; ir = ir->next, pos++) {
+        if (ir->kind != IR_CALL)
+            continue;
+        ir->live_regs = 0;
+        for (int v = 0; v < nvregs; v++) {
+            Interval *it = &intervals[v];
+            if (it->op && it->op->reg && it->start < 2 * pos &&
+                it->end > 2 * pos + 1)
+                ir->live_regs |= 1u << pool_index(it->op->reg, regs, nregs);
+        }
+    }
+}
+
+// Gives the spilled intervals stack slots, reusing the slot of an interval
+// that ended before the next one starts.
+static void assign_slots(Function *fn, Interval *intervals) {
+    Interval **sorted =
+        arena_alloc(&codegen_arena, sizeof(Interval *) * nvregs);
+    int n = 0;
+    for (int v = 0; v < nvregs; v++)
+        if (intervals[v].op && !intervals[v].op->reg)
+            sorted[n++] = &intervals[v];
+    qsort(sorted, n, sizeof(Interval *), cmp_start);
+
+    // slots[i] is free again after position ends[i]
+    Var **slots = arena_alloc(&codegen_arena, sizeof(Var *) * n);
+    int *ends = arena_alloc(&codegen_arena, sizeof(int) * n);
+    int nslots = 0;
+    for (int i = 0; i < n; i++) {
+        Interval *it = sorted[i];
+        int j = 0;
+        while (j < nslots && ends[j] >= it->start)
+            j++;
+        if (j == nslots) {
+            slots[nslots++] = new_var("", ty_int);
+            slots[j]->next = fn->locals;
+            fn->locals = slots[j];
+        }
+        ends[j] = it->end;
+        it->op->var = slots[j];
+    }
+}
+
+// Rematerializes the constants whose intervals span a call. Returns
+// whether the IR changed.
+static bool remat_constants(Function *fn, Interval *intervals) {
+    int *ndefs = arena_alloc(&codegen_arena, sizeof(int) * nvregs);
+    IR **defs = arena_alloc(&codegen_arena, sizeof(IR *) * nvregs);
+    for (IR *ir = fn->irs; ir; ir = ir->next) {
+        Operand **def = ir_def(ir);
+        if (def) {
+            ndefs[vreg(*def)]++;
+            defs[vreg(*def)] = ir;
+        }
+    }
+
+    bool *remat = arena_alloc(&codegen_arena, sizeof(bool) * nvregs);
+    bool changed = false;
+    int pos = 0;
+    for (IR *ir = fn->irs; ir; ir = ir->next, pos++) {
+        if (ir->kind != IR_CALL)
+            continue;
+        for (int v = 0; v < nvregs; v++) {
+            Interval *it = &intervals[v];
+            if (ndefs[v] == 1 && defs[v]->kind == IR_IMM &&
+                it->start < 2 * pos && it->end > 2 * pos + 1)
+                remat[v] = changed = true;
+        }
+    }
+
+    IR head = {.next = fn->irs};
+    for (IR *prev = &head; changed && prev->next;) {
+        IR *ir = prev->next;
+        Operand **def = ir_def(ir);
+        if (def && remat[vreg(*def)]) {
+            prev->next = ir->next;
+            continue;
+        }
+        Operand **uses[MAX_USES(ir)];
+        int nuses = ir_uses(ir, uses);
+        for (int j = 0; j < nuses; j++) {
+            Operand *op = *uses[j];
+            if (!remat[vreg(op)])
+                continue;
+            prev = new_ir(prev, IR_IMM, NULL, NULL, new_register(op->ty));
+            prev->val = defs[vreg(op)]->val;
+            *uses[j] = prev->dst;
+        }
+        prev = ir;
+    }
+    fn->irs = head.next;
+
+    return changed;
+}
+
+static Operand *scratch_operand(Type *ty, Register *reg) {
+    Operand *op = new_register(ty);
+    op->reg = reg;
+    return op;
+}
+
+static bool is_call(IR *ir) {
+    return ir->kind == IR_CALL || ir->kind == IR_TAIL_CALL;
+}
+
+// Routes every access to a spilled register through a scratch register:
+// reads are preceded by a reload and writes are followed by a store.
+static void rewrite_spills(Function *fn, Register **scratch) {
+    IR head = {.next = fn->irs};
+    for (IR *prev = &head, *ir = head.next; ir; prev = ir, ir = ir->next) {
+        Operand **uses[MAX_USES(ir)];
+        int nuses = is_call(ir) ? 0 : ir_uses(ir, uses);
+        for (int j = 0; j < nuses; j++) {
+            Operand *op = *uses[j];
+            if (op->reg)
+                continue;
+            prev = new_ir(prev, IR_LOAD, new_symbol(op->var), NULL,
+                          scratch_operand(ty_int, scratch[j]));
+            *uses[j] = prev->dst;
+        }
+
+        Operand **def = ir_def(ir);
+        if (def && !(*def)->reg) {
+            Operand *op = *def;
+            *def = scratch_operand(op->ty, scratch[0]);
+            ir = new_ir(ir, IR_STORE, new_symbol(op->var), *def, NULL);
+        }
+    }
+    fn->irs = head.next;
+}
+
+void alloc_regs(Function *fn, Register **regs, int nregs, Register **scratch) {
+    nvregs = reg_span(fn, &min_id);
+    fn->used_regs = 0;
+    if (nvregs == 0)
+        return;
+
+    Liveness *live = compute_liveness(fn);
+    Interval *intervals = build_intervals(fn, live);
+    if (remat_constants(fn, intervals)) {
+        build_cfg(fn);
+        nvregs = reg_span(fn, &min_id);
+        live = compute_liveness(fn);
+        intervals = build_intervals(fn, live);
+    }
+    linear_scan(fn, intervals, regs, nregs);
+    record_used_regs(fn, intervals, regs, nregs);
+    assign_slots(fn, intervals);
+    rewrite_spills(fn, scratch);
+}
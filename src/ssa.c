@@ -0,0 +1,687 @@
+#include "lucc.h"
+
+// SSA construction and destruction.
+//
+// to_ssa() rewrites every register that is assigned more than once, or
+// read somewhere its definition does not dominate, into SSA form. Phis
+// are placed on the iterated dominance frontier of its definitions
+// (Cytron et al.) and a walk over the dominator tree renames each
+// definition to a fresh register. from_ssa() turns the phis back into
+// copies before register allocation.
+//
+// A phi names the predecessor each value comes from by the label of that
+// block, which survives build_cfg() renumbering the blocks. to_ssa()
+// therefore starts every block with a label.
+
+static int reg_base, nregs;
+static int *var_of; // register id - reg_base -> variable index or -1
+static Operand **vars;
+static int nvars;
+
+static bool is_phi(IR *ir) { return ir->kind == IR_PHI; }
+
+static void label_blocks(Function *fn) {
+    IR head = {.next = fn->irs};
+    IR *prev = &head;
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        bool entry = (bb == fn->bbs);
+        if (bb->first->kind != IR_LABEL || (entry && bb->npreds > 0))
+            new_ir(prev, IR_LABEL, new_label("bb"), NULL, NULL);
+        prev = bb->last;
+    }
+    fn->irs = head.next;
+    build_cfg(fn);
+}
+
+//
+// Variables
+//
+
+static int var_index(Operand *op) {
+    int i = op->id - reg_base;
+    return (0 <= i && i < nregs) ? var_of[i] : -1;
+}
+
+static void find_vars(Function *fn) {
+    int n = nregs = reg_span(fn, &reg_base);
+    int *ndefs = arena_alloc(&opt_arena, sizeof(int) * n);
+    BasicBlock **def_bb = arena_alloc(&opt_arena, sizeof(BasicBlock *) * n);
+    int *def_pos = arena_alloc(&opt_arena, sizeof(int) * n);
+    bool *multi = arena_alloc(&opt_arena, sizeof(bool) * n);
+
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        int pos = 0;
+        for (IR *ir = bb->first;; ir = ir->next, pos++) {
+            Operand **def = ir_def(ir);
+            if (def) {
+                int v = (*def)->id - reg_base;
+                if (ndefs[v]++)
+                    multi[v] = true;
+                def_bb[v] = bb;
+                def_pos[v] = pos;
+            }
+            if (ir == bb->last)
+                break;
+        }
+    }
+
+    // A single definition must dominate all uses to already be in SSA.
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        int pos = 0;
+        for (IR *ir = bb->first;; ir = ir->next, pos++) {
+            Operand **uses[MAX_USES(ir)];
+            int nuses = ir_uses(ir, uses);
+            for (int i = 0; i < nuses; i++) {
+                int v = (*uses[i])->id - reg_base;
+                if (ndefs[v] != 1)
+                    continue;
+                if (def_bb[v] == bb ? def_pos[v] >= pos
+                                    : !dominates(def_bb[v], bb))
+                    multi[v] = true;
+            }
+            if (ir == bb->last)
+                break;
+        }
+    }
+
+    var_of = arena_alloc(&opt_arena, sizeof(int) * n);
+    vars = arena_alloc(&opt_arena, sizeof(Operand *) * n);
+    nvars = 0;
+    for (int v = 0; v < n; v++)
+        var_of[v] = -1;
+    for (IR *ir = fn->irs; ir; ir = ir->next) {
+        Operand **def = ir_def(ir);
+        if (!def || !multi[(*def)->id - reg_base])
+            continue;
+        if (var_index(*def) == -1) {
+            var_of[(*def)->id - reg_base] = nvars;
+            vars[nvars++] = *def;
+        }
+    }
+}
+
+//
+// Phi placement
+//
+
+typedef struct {
+    BasicBlock **bbs;
+    int len, cap;
+} BlockList;
+
+static void append_block(BlockList *list, BasicBlock *bb) {
+    if (list->len == list->cap) {
+        int cap = list->cap ? list->cap * 2 : 4;
+        list->bbs = arena_grow(&opt_arena, list->bbs,
+                               sizeof(BasicBlock *) * list->cap,
+                               sizeof(BasicBlock *) * cap);
+        list->cap = cap;
+    }
+    list->bbs[list->len++] = bb;
+}
+
+static void push_block(BlockList *list, BasicBlock *bb) {
+    for (int i = 0; i < list->len; i++)
+        if (list->bbs[i] == bb)
+            return;
+    append_block(list, bb);
+}
+
+static BlockList *dominance_frontiers(Function *fn) {
+    BlockList *df = arena_alloc(&opt_arena, sizeof(BlockList) * fn->nbbs);
+    for (int i = 0; i < fn->nrpo; i++) {
+        BasicBlock *bb = fn->rpo[i];
+        if (bb->npreds < 2)
+            continue;
+        for (int j = 0; j < bb->npreds; j++) {
+            BasicBlock *runner = bb->preds[j];
+            if (runner->rpo == -1)
+                continue;
+            for (; runner != bb->idom; runner = runner->idom)
+                push_block(&df[runner->id], bb);
+        }
+    }
+    return df;
+}
+
+static void insert_phi(BasicBlock *bb, int var) {
+    IR *phi = new_ir(bb->first, IR_PHI, NULL, NULL, vars[var]);
+    phi->val = var; // variable index until renamed
+    phi->nphi = bb->npreds;
+    phi->phi_vals = arena_alloc(&ir_arena, sizeof(Operand *) * bb->npreds);
+    phi->phi_labels = arena_alloc(&ir_arena, sizeof(Operand *) * bb->npreds);
+    for (int i = 0; i < bb->npreds; i++)
+        phi->phi_labels[i] = bb->preds[i]->first->lhs;
+    if (bb->last == bb->first)
+        bb->last = phi;
+}
+
+static void place_phis(Function *fn) {
+    BlockList *df = dominance_frontiers(fn);
+    BlockList *defs = arena_alloc(&opt_arena, sizeof(BlockList) * nvars);
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        if (bb->rpo == -1)
+            continue;
+        for (IR *ir = bb->first;; ir = ir->next) {
+            Operand **def = ir_def(ir);
+            if (def && var_index(*def) != -1)
+                push_block(&defs[var_index(*def)], bb);
+            if (ir == bb->last)
+                break;
+        }
+    }
+
+    // has_phi and queued remember the last variable that touched a block.
+    int *has_phi = arena_alloc(&opt_arena, sizeof(int) * fn->nbbs);
+    int *queued = arena_alloc(&opt_arena, sizeof(int) * fn->nbbs);
+    for (int v = 0; v < nvars; v++) {
+        BlockList work = defs[v];
+        for (int i = 0; i < work.len; i++)
+            queued[work.bbs[i]->id] = v + 1;
+        while (work.len > 0) {
+            BasicBlock *bb = work.bbs[--work.len];
+            for (int i = 0; i < df[bb->id].len; i++) {
+                BasicBlock *y = df[bb->id].bbs[i];
+                if (has_phi[y->id] == v + 1)
+                    continue;
+                insert_phi(y, v);
+                has_phi[y->id] = v + 1;
+                if (queued[y->id] != v + 1) {
+                    queued[y->id] = v + 1;
+                    append_block(&work, y);
+                }
+            }
+        }
+    }
+}
+
+//
+// Renaming
+//
+
+typedef struct {
+    Operand **ops;
+    int len, cap;
+} Stack;
+
+static Stack *stacks;
+static Operand **undefs;
+static Function *current_fn;
+static BlockList *children;
+
+static void push(int var, Operand *op) {
+    Stack *s = &stacks[var];
+    if (s->len == s->cap) {
+        int cap = s->cap ? s->cap * 2 : 8;
+        s->ops = arena_grow(&opt_arena, s->ops, sizeof(Operand *) * s->cap,
+                            sizeof(Operand *) * cap);
+        s->cap = cap;
+    }
+    s->ops[s->len++] = op;
+}
+
+// Reading a variable nothing was assigned to yields 0.
+static Operand *undef(int var) {
+    if (undefs[var])
+        return undefs[var];
+    BasicBlock *entry = current_fn->bbs;
+    IR *ir = new_ir(entry->first, IR_IMM, NULL, NULL,
+                    new_register(vars[var]->ty));
+    if (entry->last == entry->first)
+        entry->last = ir;
+    return undefs[var] = ir->dst;
+}
+
+static Operand *top(int var) {
+    Stack *s = &stacks[var];
+    return s->len ? s->ops[s->len - 1] : undef(var);
+}
+
+static int rename_def(Operand **def) {
+    int var = var_index(*def);
+    *def = new_register((*def)->ty);
+    push(var, *def);
+    return var;
+}
+
+static void rename_block(BasicBlock *bb) {
+    int *pushed = arena_alloc(&opt_arena, sizeof(int) * nvars);
+
+    for (IR *ir = bb->first;; ir = ir->next) {
+        if (is_phi(ir)) {
+            Operand *var = vars[ir->val];
+            ir->dst = var;
+            pushed[rename_def(&ir->dst)]++;
+        } else {
+            Operand **uses[MAX_USES(ir)];
+            int nuses = ir_uses(ir, uses);
+            for (int i = 0; i < nuses; i++)
+                if (var_index(*uses[i]) != -1)
+                    *uses[i] = top(var_index(*uses[i]));
+            Operand **def = ir_def(ir);
+            if (def && var_index(*def) != -1)
+                pushed[rename_def(def)]++;
+        }
+        if (ir == bb->last)
+            break;
+    }
+
+    for (int i = 0; i < bb->nsuccs; i++) {
+        BasicBlock *succ = bb->succs[i];
+        for (IR *phi = succ->first->next; phi && is_phi(phi); phi = phi->next)
+            for (int j = 0; j < phi->nphi; j++)
+                if (phi->phi_labels[j] == bb->first->lhs)
+                    phi->phi_vals[j] = top(phi->val);
+    }
+
+    for (int i = 0; i < children[bb->id].len; i++)
+        rename_block(children[bb->id].bbs[i]);
+
+    for (int v = 0; v < nvars; v++)
+        stacks[v].len -= pushed[v];
+}
+
+static void rename_vars(Function *fn) {
+    current_fn = fn;
+    stacks = arena_alloc(&opt_arena, sizeof(Stack) * nvars);
+    undefs = arena_alloc(&opt_arena, sizeof(Operand *) * nvars);
+    children = arena_alloc(&opt_arena, sizeof(BlockList) * fn->nbbs);
+    for (int i = 0; i < fn->nrpo; i++)
+        if (fn->rpo[i]->idom)
+            push_block(&children[fn->rpo[i]->idom->id], fn->rpo[i]);
+    rename_block(fn->bbs);
+}
+
+void to_ssa(Function *fn) {
+    if (!fn->irs)
+        return;
+    label_blocks(fn);
+    find_vars(fn);
+    if (nvars == 0)
+        return;
+    place_phis(fn);
+    rename_vars(fn);
+    build_cfg(fn);
+}
+
+//
+// Destruction
+//
+// Each phi gets a fresh temporary which every predecessor assigns its
+// value to right before leaving; the phi itself becomes a copy from that
+// temporary. Since no temporary is shared, the copies can go to the end
+// of a predecessor even when it has other successors, and parallel phis
+// cannot clobber each other. A phi which gets the same value on every
+// edge simply becomes a copy of that value. The copies are then
+// coalesced, see below.
+//
+
+static void append_copy(BasicBlock *bb, Operand *dst, Operand *src) {
+    IR *prev = bb->last;
+    if (jump_target(bb->last)) {
+        for (prev = bb->first; prev->next != bb->last; prev = prev->next)
+            ;
+    }
+    IR *ir = new_ir(prev, IR_MOV, src, NULL, dst);
+    if (prev == bb->last)
+        bb->last = ir;
+}
+
+static void remove_unused_labels(Function *fn) {
+    int lo = -1, hi = -1;
+    for (IR *ir = fn->irs; ir; ir = ir->next) {
+        if (ir->kind != IR_LABEL)
+            continue;
+        if (lo == -1 || ir->lhs->id < lo)
+            lo = ir->lhs->id;
+        if (ir->lhs->id > hi)
+            hi = ir->lhs->id;
+    }
+    if (lo == -1)
+        return;
+
+    bool *used = arena_alloc(&opt_arena, sizeof(bool) * (hi - lo + 1));
+    for (IR *ir = fn->irs; ir; ir = ir->next) {
+        Operand *target = jump_target(ir);
+        if (target && lo <= target->id && target->id <= hi)
+            used[target->id - lo] = true;
+    }
+    IR head = {.next = fn->irs};
+    for (IR *prev = &head; prev->next;) {
+        IR *ir = prev->next;
+        if (ir->kind == IR_LABEL && !used[ir->lhs->id - lo])
+            prev->next = ir->next;
+        else
+            prev = ir;
+    }
+    fn->irs = head.next;
+}
+
+//
+// Copy coalescing
+//
+// Left alone, destruction costs every loop-carried variable two registers
+// and two moves per iteration. Registers related by a copy are therefore
+// merged into one wherever they do not interfere, that is, wherever
+// neither is defined while the other is live, save for a copy reading the
+// other. Since the backends emit "mov lhs, dst; op rhs, dst", a definition
+// also interferes with the registers its rhs reads. Copies in inner loops
+// go first, as merging two registers may stop later copies from merging.
+// A class keeps the operand of its representative throughout; classes are
+// only formed from registers of the same size, and an array's address is
+// never merged with a plain value because loads treat the two apart.
+//
+
+static int *cand_of; // register id - reg_base -> candidate index or -1
+static Operand **cands;
+static int ncands, nwords;
+static unsigned long *adj; // interference rows, nwords per candidate
+static int *leader;
+
+static bool has(unsigned long *set, int i) { return set[i / 64] >> i % 64 & 1; }
+static void add(unsigned long *set, int i) { set[i / 64] |= 1UL << i % 64; }
+static void del(unsigned long *set, int i) { set[i / 64] &= ~(1UL << i % 64); }
+static unsigned long *row(int i) { return adj + (size_t)i * nwords; }
+
+static int cand(Operand *op) {
+    int i = op->id - reg_base;
+    return (0 <= i && i < nregs) ? cand_of[i] : -1;
+}
+
+static bool is_copy(IR *ir) {
+    if (ir->kind != IR_MOV || ir->lhs->kind != OP_REGISTER)
+        return false;
+    Type *a = ir->lhs->ty, *b = ir->dst->ty;
+    return a->size == b->size &&
+           (a->kind == TY_ARRAY) == (b->kind == TY_ARRAY);
+}
+
+static void add_cand(Operand *op) {
+    int i = op->id - reg_base;
+    if (cand_of[i] == -1) {
+        cand_of[i] = ncands;
+        cands[ncands++] = op;
+    }
+}
+
+static void find_cands(Function *fn) {
+    int n = nregs = reg_span(fn, &reg_base);
+    cand_of = arena_alloc(&opt_arena, sizeof(int) * n);
+    cands = arena_alloc(&opt_arena, sizeof(Operand *) * n);
+    ncands = 0;
+    for (int v = 0; v < n; v++)
+        cand_of[v] = -1;
+    for (IR *ir = fn->irs; ir; ir = ir->next) {
+        if (is_copy(ir)) {
+            add_cand(ir->lhs);
+            add_cand(ir->dst);
+        }
+    }
+    nwords = (ncands + 63) / 64;
+}
+
+// Returns the live-out sets of the blocks, over candidates only.
+static unsigned long **live_out(Function *fn) {
+    size_t size = sizeof(unsigned long) * nwords;
+    unsigned long **use = arena_alloc(&opt_arena, sizeof(*use) * fn->nbbs);
+    unsigned long **def = arena_alloc(&opt_arena, sizeof(*def) * fn->nbbs);
+    unsigned long **in = arena_alloc(&opt_arena, sizeof(*in) * fn->nbbs);
+    unsigned long **out = arena_alloc(&opt_arena, sizeof(*out) * fn->nbbs);
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        int b = bb->id;
+        use[b] = arena_alloc(&opt_arena, size);
+        def[b] = arena_alloc(&opt_arena, size);
+        in[b] = arena_alloc(&opt_arena, size);
+        out[b] = arena_alloc(&opt_arena, size);
+        for (IR *ir = bb->first;; ir = ir->next) {
+            Operand **uses[MAX_USES(ir)];
+            int nuses = ir_uses(ir, uses);
+            for (int i = 0; i < nuses; i++) {
+                int c = cand(*uses[i]);
+                if (c != -1 && !has(def[b], c))
+                    add(use[b], c);
+            }
+            Operand **d = ir_def(ir);
+            if (d && cand(*d) != -1)
+                add(def[b], cand(*d));
+            if (ir == bb->last)
+                break;
+        }
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = fn->nrpo - 1; i >= 0; i--) {
+            int b = fn->rpo[i]->id;
+            BasicBlock *bb = fn->rpo[i];
+            for (int w = 0; w < nwords; w++) {
+                unsigned long o = 0;
+                for (int j = 0; j < bb->nsuccs; j++)
+                    o |= in[bb->succs[j]->id][w];
+                unsigned long n = use[b][w] | (o & ~def[b][w]);
+                if (o != out[b][w] || n != in[b][w])
+                    changed = true;
+                out[b][w] = o;
+                in[b][w] = n;
+            }
+        }
+    }
+    return out;
+}
+
+static void interfere(int a, int b) {
+    if (a != b) {
+        add(row(a), b);
+        add(row(b), a);
+    }
+}
+
+static void interfere_reg(int d, Operand *op) {
+    if (op && op->kind == OP_REGISTER && cand(op) != -1)
+        interfere(d, cand(op));
+}
+
+// The registers in the rhs of ir, which it reads after writing its dst.
+static void interfere_rhs(IR *ir, int d) {
+    Operand *rhs = ir->rhs;
+    if (rhs && rhs->kind == OP_ADDRESS) {
+        interfere_reg(d, rhs->base);
+        interfere_reg(d, rhs->index);
+    } else {
+        interfere_reg(d, rhs);
+    }
+}
+
+static void build_interference(Function *fn) {
+    unsigned long **out = live_out(fn);
+    adj = arena_alloc(&opt_arena,
+                      sizeof(unsigned long) * nwords * (size_t)ncands);
+    unsigned long *live = arena_alloc(&opt_arena, sizeof(*live) * nwords);
+    IR **irs = NULL;
+    int cap = 0;
+
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        int n = 0;
+        for (IR *ir = bb->first;; ir = ir->next) {
+            if (n == cap) {
+                irs = arena_grow(&opt_arena, irs, sizeof(IR *) * cap,
+                                 sizeof(IR *) * (cap ? cap * 2 : 64));
+                cap = cap ? cap * 2 : 64;
+            }
+            irs[n++] = ir;
+            if (ir == bb->last)
+                break;
+        }
+
+        memcpy(live, out[bb->id], sizeof(*live) * nwords);
+        while (n--) {
+            IR *ir = irs[n];
+            Operand **def = ir_def(ir);
+            int d = def ? cand(*def) : -1;
+            if (d != -1) {
+                int src = is_copy(ir) ? cand(ir->lhs) : -1;
+                bool src_live = src != -1 && has(live, src);
+                if (src_live)
+                    del(live, src);
+                for (int w = 0; w < nwords; w++)
+                    row(d)[w] |= live[w];
+                for (int w = 0; w < nwords; w++)
+                    for (unsigned long bits = live[w]; bits; bits &= bits - 1)
+                        add(row(w * 64 + __builtin_ctzl(bits)), d);
+                del(row(d), d);
+                if (src_live)
+                    add(live, src);
+                interfere_rhs(ir, d);
+                del(live, d);
+            }
+            Operand **uses[MAX_USES(ir)];
+            int nuses = ir_uses(ir, uses);
+            for (int i = 0; i < nuses; i++)
+                if (cand(*uses[i]) != -1)
+                    add(live, cand(*uses[i]));
+        }
+    }
+}
+
+static int find(int c) {
+    while (leader[c] != c)
+        c = leader[c] = leader[leader[c]];
+    return c;
+}
+
+// Merges class b into class a. Whatever interfered with b now interferes
+// with a; the rows may name members, so they are mapped to their classes.
+static void merge(int a, int b) {
+    leader[b] = a;
+    for (int w = 0; w < nwords; w++)
+        for (unsigned long bits = row(b)[w]; bits; bits &= bits - 1)
+            interfere(a, find(w * 64 + __builtin_ctzl(bits)));
+}
+
+typedef struct {
+    IR *ir;
+    int depth, order;
+} Copy;
+
+static int cmp_depth(const void *a, const void *b) {
+    const Copy *x = a, *y = b;
+    if (x->depth != y->depth)
+        return y->depth - x->depth;
+    return x->order - y->order;
+}
+
+static void rewrite_operand(Operand **op) {
+    int c = cand(*op);
+    if (c != -1)
+        *op = cands[find(c)];
+}
+
+static void coalesce_copies(Function *fn) {
+    find_cands(fn);
+    if (ncands == 0)
+        return;
+    build_interference(fn);
+
+    Copy *copies = NULL;
+    int ncopies = 0;
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        for (IR *ir = bb->first;; ir = ir->next) {
+            if (is_copy(ir)) {
+                copies = arena_grow(&opt_arena, copies, sizeof(Copy) * ncopies,
+                                    sizeof(Copy) * (ncopies + 1));
+                copies[ncopies] = (Copy){ir, bb->loop_depth, ncopies};
+                ncopies++;
+            }
+            if (ir == bb->last)
+                break;
+        }
+    }
+    qsort(copies, ncopies, sizeof(Copy), cmp_depth);
+
+    leader = arena_alloc(&opt_arena, sizeof(int) * ncands);
+    for (int c = 0; c < ncands; c++)
+        leader[c] = c;
+    for (int i = 0; i < ncopies; i++) {
+        int a = find(cand(copies[i].ir->dst));
+        int b = find(cand(copies[i].ir->lhs));
+        if (a != b && !has(row(a), b))
+            merge(a, b);
+    }
+
+    IR head = {.next = fn->irs};
+    for (IR *prev = &head; prev->next;) {
+        IR *ir = prev->next;
+        Operand **uses[MAX_USES(ir)];
+        int nuses = ir_uses(ir, uses);
+        for (int i = 0; i < nuses; i++)
+            rewrite_operand(uses[i]);
+        Operand **def = ir_def(ir);
+        if (def)
+            rewrite_operand(def);
+        if (is_copy(ir) && ir->lhs == ir->dst)
+            prev->next = ir->next;
+        else
+            prev = ir;
+    }
+    fn->irs = head.next;
+    build_cfg(fn);
+}
+
+// Returns the value a phi has on every edge that defines it, or NULL if
+// the edges disagree. Only a value no phi of bb defines qualifies: such
+// a value dominates bb and still holds it on entry, after bb's phis have
+// become copies.
+static Operand *single_value(BasicBlock *bb, IR *phi) {
+    Operand *val = NULL;
+    for (int i = 0; i < phi->nphi; i++) {
+        if (!phi->phi_vals[i])
+            continue;
+        if (val && val->id != phi->phi_vals[i]->id)
+            return NULL;
+        val = phi->phi_vals[i];
+    }
+    if (!val || val->kind != OP_REGISTER)
+        return NULL;
+    for (IR *ir = bb->first;; ir = ir->next) {
+        if (is_phi(ir) && ir->dst->id == val->id)
+            return NULL;
+        if (ir == bb->last)
+            return val;
+    }
+}
+
+void from_ssa(Function *fn) {
+    for (BasicBlock *bb = fn->bbs; bb; bb = bb->next) {
+        for (IR *ir = bb->first;; ir = ir->next) {
+            Operand *val = is_phi(ir) ? single_value(bb, ir) : NULL;
+            if (val) {
+                ir->kind = IR_MOV;
+                ir->lhs = val;
+                ir->nphi = 0;
+            } else if (is_phi(ir)) {
+                Operand *tmp = new_register(ir->dst->ty);
+                for (int i = 0; i < bb->npreds; i++) {
+                    BasicBlock *pred = bb->preds[i];
+                    assert(pred->first->kind == IR_LABEL);
+                    if (i > 0 && bb->preds[i - 1] == pred)
+                        continue;
+                    for (int j = 0; j < ir->nphi; j++) {
+                        if (ir->phi_labels[j] != pred->first->lhs ||
+                            !ir->phi_vals[j])
+                            continue;
+                        append_copy(pred, tmp, ir->phi_vals[j]);
+                        break;
+                    }
+                }
+                ir->kind = IR_MOV;
+                ir->lhs = tmp;
+                ir->nphi = 0;
+            }
+            if (ir == bb->last)
+                break;
+        }
+    }
+    remove_unused_labels(fn);
+    build_cfg(fn);
+    coalesce_copies(fn);
+}
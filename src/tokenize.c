@@ -1,32 +1,262 @@
 #include "lucc.h"
 
+#if defined(__SSE2__) && !defined(NO_SIMD)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
+
+static char *current_filename;
 static char *current_input;
-static char *MULTIPUNCT[] = {"==", "<=", ">=", "!="};
-static char *KEYWORDS[] = {"return", "if",    "then",  "else",
-                           "for",    "while", "sizeof"};
-
-static bool startswith(char *p, char *s) { return !strncmp(p, s, strlen(s)); }
-static int is_multipunct(char *p) {
-    for (int i = 0; i < sizeof(MULTIPUNCT) / sizeof(*MULTIPUNCT); i++) {
-        if (startswith(p, MULTIPUNCT[i]))
-            return strlen(MULTIPUNCT[i]);
+
+char *reserved_names[NUM_RESERVED] = {
+    [P_EQ] = "==",        [P_NE] = "!=",        [P_LE] = "<=",
+    [P_GE] = ">=",        [P_LT] = "<",         [P_GT] = ">",
+    [P_ASSIGN] = "=",     [P_ADD] = "+",        [P_SUB] = "-",
+    [P_MUL] = "*",        [P_DIV] = "/",        [P_AMP] = "&",
+    [P_LPAREN] = "(",     [P_RPAREN] = ")",     [P_LBRACKET] = "[",
+    [P_RBRACKET] = "]",   [P_LBRACE] = "{",     [P_RBRACE] = "}",
+    [P_SEMICOLON] = ";",  [P_COMMA] = ",",      [KW_RETURN] = "return",
+    [KW_IF] = "if",       [KW_THEN] = "then",   [KW_ELSE] = "else",
+    [KW_FOR] = "for",     [KW_WHILE] = "while", [KW_SIZEOF] = "sizeof",
+    [KW_INT] = "int",
+};
+
+// Keywords are looked up in a table indexed by a perfect hash of their
+// first letter and length. Any other identifier lands on some keyword too,
+// so the spelling still has to be compared, but only with that one.
+#define KEYWORD_HASH(c, len) (((c) * 7 + (len)) & 7)
+
+static struct {
+    char *name;
+    Reserved id;
+} keywords[8] = {
+    [KEYWORD_HASH('r', 6)] = {"return", KW_RETURN},
+    [KEYWORD_HASH('i', 2)] = {"if", KW_IF},
+    [KEYWORD_HASH('t', 4)] = {"then", KW_THEN},
+    [KEYWORD_HASH('e', 4)] = {"else", KW_ELSE},
+    [KEYWORD_HASH('f', 3)] = {"for", KW_FOR},
+    [KEYWORD_HASH('w', 5)] = {"while", KW_WHILE},
+    [KEYWORD_HASH('s', 6)] = {"sizeof", KW_SIZEOF},
+    [KEYWORD_HASH('i', 3)] = {"int", KW_INT},
+};
+
+// Returns the keyword spelled by the len bytes at p, or -1.
+static int find_keyword(char *p, int len) {
+    int h = KEYWORD_HASH(p[0], len);
+    char *name = keywords[h].name;
+    if (name && !strncmp(p, name, len) && name[len] == '\0')
+        return keywords[h].id;
+    return -1;
+}
+
+// Returns the punctuator at p and its length, or -1.
+static int read_punct(char *p, int *len) {
+    *len = 2;
+    if (p[1] == '=') {
+        switch (p[0]) {
+        case '=':
+            return P_EQ;
+        case '!':
+            return P_NE;
+        case '<':
+            return P_LE;
+        case '>':
+            return P_GE;
+        }
+    }
+    *len = 1;
+    switch (p[0]) {
+    case '<':
+        return P_LT;
+    case '>':
+        return P_GT;
+    case '=':
+        return P_ASSIGN;
+    case '+':
+        return P_ADD;
+    case '-':
+        return P_SUB;
+    case '*':
+        return P_MUL;
+    case '/':
+        return P_DIV;
+    case '&':
+        return P_AMP;
+    case '(':
+        return P_LPAREN;
+    case ')':
+        return P_RPAREN;
+    case '[':
+        return P_LBRACKET;
+    case ']':
+        return P_RBRACKET;
+    case '{':
+        return P_LBRACE;
+    case '}':
+        return P_RBRACE;
+    case ';':
+        return P_SEMICOLON;
+    case ',':
+        return P_COMMA;
     }
-    return 0;
+    return -1;
 }
 
+//
+// Identifiers
+//
+// Every distinct identifier is stored once, in an open-addressing hash
+// table, and gets the next id. Names can then be compared by pointer.
+//
+
+typedef struct {
+    char *name;
+    int len;
+    int id;
+} Symbol;
+
+static Symbol *symbols;
+static int symbols_cap;
+static int nsymbols;
+
+// symbol id -> name
+static char **names;
+
+static uint32_t hash_name(char *p, int len) {
+    uint32_t h = 2166136261;
+    for (int i = 0; i < len; i++)
+        h = (h ^ (unsigned char)p[i]) * 16777619;
+    return h;
+}
+
+static Symbol *find_slot(Symbol *table, int cap, char *p, int len) {
+    for (uint32_t i = hash_name(p, len);; i++) {
+        Symbol *sym = &table[i & (cap - 1)];
+        if (!sym->name ||
+            (sym->len == len && !strncmp(sym->name, p, len)))
+            return sym;
+    }
+}
+
+// Keeps the table at most half full. The old tables stay behind in the
+// arena, together smaller than the new one.
+static void grow_symbols(void) {
+    int cap = symbols_cap ? symbols_cap * 2 : 256;
+    Symbol *table = arena_alloc(&ir_arena, sizeof(Symbol) * cap);
+    for (int i = 0; i < symbols_cap; i++)
+        if (symbols[i].name)
+            *find_slot(table, cap, symbols[i].name, symbols[i].len) =
+                symbols[i];
+    symbols = table;
+    symbols_cap = cap;
+}
+
+static Symbol *intern(char *p, int len) {
+    if ((nsymbols + 1) * 2 > symbols_cap) {
+        int old = symbols_cap / 2;
+        grow_symbols();
+        names = arena_grow(&ir_arena, names, sizeof(char *) * old,
+                           sizeof(char *) * symbols_cap / 2);
+    }
+    Symbol *sym = find_slot(symbols, symbols_cap, p, len);
+    if (!sym->name) {
+        // Variables and functions keep the names after the tokens are gone.
+        sym->name = arena_strndup(&ir_arena, p, len);
+        sym->len = len;
+        sym->id = nsymbols++;
+        names[sym->id] = sym->name;
+    }
+    return sym;
+}
+
+char *symbol_name(int id) { return names[id]; }
+
+//
+// Scanning
+//
+// Runs of whitespace, identifier characters and digits are skipped 16
+// bytes at a time with SSE2 where available. Every load is aligned, so it
+// never reaches into a page past the NUL ending the input; the bytes it
+// reads before the start of the run or after the NUL are masked off.
+//
+
+typedef enum {
+    CC_SPACE, // isspace
+    CC_IDENT, // letters, digits and '_'
+    CC_DIGIT,
+} CharClass;
+
 static bool is_alpha(char p) {
     return p == '_' || ('a' <= p && p <= 'z') || ('A' <= p && p <= 'Z');
 }
-static bool is_alnum(char p) { return is_alpha(p) || ('0' <= p && p <= '9'); }
+static bool is_digit(char p) { return '0' <= p && p <= '9'; }
+static bool is_space(char p) { return p == ' ' || ('\t' <= p && p <= '\r'); }
+
+#ifdef USE_SSE2
+// Returns whether each byte of x is in [lo, hi], as a vector of 0x00 or
+// 0xff. Bytes are compared unsigned after moving lo to 0.
+static __m128i in_range(__m128i x, char lo, char hi) {
+    __m128i d = _mm_sub_epi8(x, _mm_set1_epi8(lo));
+    __m128i max = _mm_set1_epi8(hi - lo);
+    return _mm_cmpeq_epi8(_mm_min_epu8(d, max), d);
+}
+
+// Returns a bit per byte of the block at p, set for the bytes in cls.
+static unsigned class_mask(char *p, CharClass cls) {
+    __m128i x = _mm_load_si128((__m128i *)p);
+    __m128i m;
+    switch (cls) {
+    case CC_SPACE:
+        m = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+                         in_range(x, '\t', '\r'));
+        break;
+    case CC_IDENT:
+        // Setting bit 5 maps 'A'-'Z' onto 'a'-'z'.
+        m = _mm_or_si128(
+            _mm_or_si128(in_range(x, '0', '9'),
+                         in_range(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a',
+                                  'z')),
+            _mm_cmpeq_epi8(x, _mm_set1_epi8('_')));
+        break;
+    case CC_DIGIT:
+        m = in_range(x, '0', '9');
+        break;
+    }
+    return _mm_movemask_epi8(m);
+}
 
-static bool is_keyword(Token *tok) {
-    for (int i = 0; i < sizeof(KEYWORDS) / sizeof(*KEYWORDS); i++) {
-        if (equal(tok, KEYWORDS[i]))
-            return true;
+// Returns the first byte at or after p that is not in cls. The NUL at the
+// end of the input is in no class.
+static char *skip_class(char *p, CharClass cls) {
+    int offset = (uintptr_t)p & 15;
+    char *block = p - offset;
+    unsigned rest = ~class_mask(block, cls) & 0xffff & (0xffff << offset);
+    while (!rest) {
+        block += 16;
+        rest = ~class_mask(block, cls) & 0xffff;
+    }
+    return block + __builtin_ctz(rest);
+}
+#else
+static bool in_class(char c, CharClass cls) {
+    switch (cls) {
+    case CC_SPACE:
+        return is_space(c);
+    case CC_IDENT:
+        return is_alpha(c) || is_digit(c);
+    case CC_DIGIT:
+        return is_digit(c);
     }
     return false;
 }
 
+static char *skip_class(char *p, CharClass cls) {
+    while (in_class(*p, cls))
+        p++;
+    return p;
+}
+#endif
+
 noreturn void error(char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
@@ -34,12 +264,24 @@ noreturn void error(char *fmt, ...) {
     fprintf(stderr, "\n");
     exit(1);
 }
+// Reports an error as file:line:col, followed by the line in question
+// and a caret under loc.
 static void verror_at(char *loc, char *fmt, va_list ap) {
-    fprintf(stderr, "%s\n", current_input);
-    fprintf(stderr, "%*s", (int)(loc - current_input), " ");
-    fprintf(stderr, "^ ");
+    char *line = loc;
+    while (current_input < line && line[-1] != '\n')
+        line--;
+    char *end = loc;
+    while (*end && *end != '\n')
+        end++;
+    int lineno = 1;
+    for (char *p = current_input; p < line; p++)
+        if (*p == '\n')
+            lineno++;
+    int col = loc - line + 1;
+
+    fprintf(stderr, "%s:%d:%d: ", current_filename, lineno, col);
     vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
+    fprintf(stderr, "\n%.*s\n%*s^\n", (int)(end - line), line, col - 1, "");
 }
 static noreturn void error_at(char *loc, char *fmt, ...) {
     va_list ap;
@@ -50,68 +292,111 @@ static noreturn void error_at(char *loc, char *fmt, ...) {
 noreturn void error_tok(Token *tok, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    verror_at(tok->loc, fmt, ap);
+    verror_at(token_loc(tok), fmt, ap);
     exit(1);
 }
 
-Token *new_token(Token *cur, TokenKind kind, char *loc, int len) {
-    Token *tok = calloc(1, sizeof(Token));
-    tok->kind = kind;
-    tok->loc = loc;
-    tok->len = len;
-    cur->next = tok;
-    return tok;
-}
+char *token_loc(Token *tok) { return current_input + tok->loc; }
 
-void convert_keywords(Token *tok) {
-    for (Token *t = tok; t->kind != TK_EOF; t = t->next)
-        if (t->kind == TK_IDENT && is_keyword(t))
-            t->kind = TK_RESERVED;
+static Token *tokens;
+static int ntokens;
+static int tokens_cap;
+
+// The returned token stays in place only until the next one is added.
+static Token *new_token(TokenKind kind, char *loc, int len) {
+    if (len > UINT16_MAX)
+        error_at(loc, "token too long");
+    if (ntokens == tokens_cap) {
+        tokens = arena_grow(&tokens_arena, tokens, sizeof(Token) * tokens_cap,
+                            sizeof(Token) * tokens_cap * 2);
+        tokens_cap *= 2;
+    }
+    Token *tok = &tokens[ntokens++];
+    *tok = (Token){.loc = loc - current_input, .len = len, .kind = kind};
+    return tok;
 }
 
-Token *tokenize(char *input) {
+Token *tokenize(char *filename, char *input) {
+    current_filename = filename;
     current_input = input;
     char *p = input;
 
-    Token head = {};
-    Token *cur = &head;
+    size_t size = strlen(input);
+    if (size > UINT32_MAX)
+        error("%s: file too large", filename);
+    // Most inputs have fewer tokens than that. Pages of the array that
+    // are never written to do not take up memory.
+    tokens_cap = size / 4 + 16;
+    tokens = arena_alloc(&tokens_arena, sizeof(Token) * tokens_cap);
+    ntokens = 0;
+
     while (*p) {
-        if (isspace(*p)) {
-            p++;
+        if (is_space(*p)) {
+            p = skip_class(p, CC_SPACE);
+            continue;
+        }
+        // The C library searches for the end of a comment word-wise.
+        if (p[0] == '/' && p[1] == '/') {
+            p = strchrnul(p + 2, '\n');
             continue;
         }
-        if (is_multipunct(p)) {
-            int len = is_multipunct(p);
-            cur = new_token(cur, TK_RESERVED, p, len);
-            p += cur->len;
+        if (p[0] == '/' && p[1] == '*') {
+            char *q = strstr(p + 2, "*/");
+            if (!q)
+                error_at(p, "unclosed block comment");
+            p = q + 2;
             continue;
         }
         if (is_alpha(*p)) {
-            char *q = p;
-            while (is_alnum(*q))
-                q++;
-            cur = new_token(cur, TK_IDENT, p, q - p);
-            p += cur->len;
+            char *q = skip_class(p, CC_IDENT);
+            int kw = find_keyword(p, q - p);
+            if (kw != -1)
+                new_token(TK_RESERVED, p, q - p)->id = kw;
+            else
+                new_token(TK_IDENT, p, q - p)->id = intern(p, q - p)->id;
+            p = q;
             continue;
         }
-        if (ispunct(*p)) {
-            cur = new_token(cur, TK_RESERVED, p, 1);
-            p += cur->len;
+        int len;
+        int punct = read_punct(p, &len);
+        if (punct != -1) {
+            new_token(TK_RESERVED, p, len)->id = punct;
+            p += len;
             continue;
         }
-        if (isdigit(*p)) {
-            char *q = p;
-            long val = strtol(q, &q, 10);
-            cur = new_token(cur, TK_NUM, p, q - p);
-            cur->val = val;
-            p += cur->len;
+        // The value is read by the parser.
+        if (is_digit(*p)) {
+            char *q = skip_class(p, CC_DIGIT);
+            new_token(TK_NUM, p, q - p);
+            p = q;
             continue;
         }
         error_at(p, "unknown character");
     }
-    cur = new_token(cur, TK_EOF, p, 0);
+    new_token(TK_EOF, p, 0);
+    return tokens;
+}
+
+// Maps the file at path into memory instead of reading it, so that tokens
+// point right into the page cache. The tokenizer needs a NUL after the
+// text: the rest of the file's last page reads as zeros, and an anonymous
+// page reserved behind the file covers the case where it fills that page.
+static char *map_file(char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+        error("cannot open %s: %s", path, strerror(errno));
 
-    // preprocess
-    convert_keywords(head.next);
-    return head.next;
+    size_t size = st.st_size;
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *buf = mmap(NULL, (size / page + 1) * page, PROT_READ,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED ||
+        (size > 0 && mmap(buf, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd,
+                          0) == MAP_FAILED))
+        error("cannot map %s: %s", path, strerror(errno));
+    close(fd);
+    return buf;
 }
+
+Token *tokenize_file(char *path) { return tokenize(path, map_file(path)); }
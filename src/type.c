@@ -11,10 +11,10 @@ bool is_integer(Type *ty) { return ty->kind == TY_INT; }
 bool is_scalar(Type *ty) { return is_integer(ty); }
 bool is_pointing(Type *ty) { return ty->base; }
 int size_of(Type *ty) { return ty->size; }
-bool is_typename(Token *tok) { return equal(tok, "int"); }
+bool is_typename(Token *tok) { return equal(tok, KW_INT); }
 
 static Type *new_type(TypeKind kind, int size, int align) {
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_alloc(&ir_arena, sizeof(Type));
     ty->kind = kind;
     ty->size = size;
     ty->align = align;
@@ -22,7 +22,7 @@ static Type *new_type(TypeKind kind, int size, int align) {
 }
 
 Type *copy_type(Type *ty) {
-    Type *new_ty = calloc(1, sizeof(Type));
+    Type *new_ty = arena_alloc(&ir_arena, sizeof(Type));
     *new_ty = *ty;
     return new_ty;
 }
@@ -14,7 +14,7 @@ function assert-x64 {
     want=$1
     input=$2
 
-    $BIN "$input" > tmp.s || exit 1
+    $BIN -o tmp.s "$input" || exit 1
     CC=cc
     $CC -c -o tests/extern.o tests/extern.c
     $CC -static -o tmp tmp.s tests/extern.o
@@ -32,7 +32,7 @@ function assert-x64 {
 function assert-riscv {
     want=$1
     input=$2
-    $BIN -march=riscv "$input" > tmp.s || exit 1
+    $BIN -march=riscv -o tmp.s "$input" || exit 1
     CC=riscv64-linux-gnu-gcc-8
     $CC -c -o tests/extern-riscv.o tests/extern.c
     $CC -static -o tmp tmp.s tests/extern-riscv.o
@@ -80,6 +80,9 @@ assert 1 'int main(){return 0<=1;}'
 assert 0 'int main(){return 0>1;}'
 assert 0 'int main(){return 0>=1;}'
 
+assert 55 'int main(){return 1+(2+(3+(4+(5+(6+(7+(8+(9+10))))))));}'
+assert 5 'int main(){return -(-5);}'
+assert 5 'int main(){int a=2; int b=a*3; return b-1;}'
 assert 3 'int main(){1; 2; return 3;}'
 assert 3 'int main(){1; return 3; 2;}'
 assert 10 'int main(){1;2;3;4;5;6;7;8;9;return 10;11;12;13;14;}'
@@ -87,6 +90,11 @@ assert 4 'int main(){int a=4; return a;}'
 assert 4 'int main(){int abc=4; return abc;}'
 assert 2 'int main(){int K=5; int t_t = 2; int abc=4; int a123=123;return t_t;}'
 assert 44 'int main(){int a,b; a = b = 44; return a;}'
+assert 15 'int main(){int iff=1; int intx=2; int fort=3; int returned=4; int els=5; return iff+intx+fort+returned+els;}'
+assert 3 'int main(){ /* one */ int a=1; // two
+    return a /* three */ + 2; // four
+}'
+assert 7 'int main(){int                                                  spaces_and_a_rather_long_identifier_name=7; return spaces_and_a_rather_long_identifier_name;}'
 assert 42 'int main(){if (1) return 42; return 0;}'
 assert 0 'int main(){if (0) return 42; return 0;}'
 assert 42 'int main(){if (1) return 42; else return 0;}'
@@ -96,12 +104,38 @@ assert 5 'int main(){int a=0; for (;a<5;a=a+1) 0; return a;}'
 assert 5 'int main(){int a=0; while (a<5) a=a+1; return a;}'
 
 assert 15 'int main(){int a=0; int b=0; while(a<5) {a=a+1; b=b+a;} return b;}'
+assert 3 'int main(){int a=0; while (a!=3) a=a+1; return a;}'
+assert 6 'int main(){int a=0; for (;a<=5;a=a+1) 0; return a;}'
+assert 7 'int main(){int a=9; while (a>7) a=a-1; return a;}'
+assert 6 'int main(){int a=9; while (a>=7) a=a-1; return a;}'
+assert 4 'int main(){int a=4; if (a==4) return a; return 0;}'
+assert 4 'int main(){int a=0; int b=0; for(;a<3;a=a+1) { int c=0; while(c<a) {c=c+1; b=b+c;}} return b;}'
+assert 10 'int main(){int x; int i; for(i=0;i<3;i=i+1){ if (i==1) x=10; else x=x+0; } return x;}'
+assert 4 'int main(){int a=3; int b=4; int i=0; while(i<3){int t=a; a=b; b=t; i=i+1;} return a;}'
+assert 21 'int main(){int a=1; int b=2; int i; for(i=0;i<5;i=i+1){int t=a; a=b; b=t;} return a*10+b;}'
+assert 55 'int main(){int a=0; int b=1; int i; for(i=0;i<10;i=i+1){int t=a+b; a=b; b=t;} return a;}'
+assert 65 'int main(){int x=0; int y=0; int i; for(i=0;i<7;i=i+1){y=x; x=i;} return x*10+y;}'
+assert 132 'int main(){int a=1; int b=2; int c=3; int d=4; int e=5; int f=6; int g=7; int h=8; int i; int j=9; int k=10; int l=11; int m=12; for(i=0;i<10;i=i+1){int t=a; a=b; b=c; c=d; d=e; e=f; f=g; g=h; h=j; j=k; k=l; l=m; m=t;} return a+b*2+c*3+d+e+f+g+h+j+k+l+m*5;}'
+assert 55 'int main(){return sum(10);} int sum(int n){int s=0; int i=0; for(i=1;i<=n;i=i+1) s=s+i; return s;}'
+assert 35 'int main(){int a=5; return a*7;}'
+assert 253 'int main(){int a=0-7; return a/2;}'
+assert 242 'int main(){int a=0-100; return a/7;}'
+assert 14 'int main(){int a=100; return a/7 + a*0 + a/1 - a;}'
+assert 60 'int main(){int x[3][4]; int i; int j; int s=0; for(i=0;i<3;i=i+1) for(j=0;j<4;j=j+1) x[i][j]=i+j; for(i=0;i<3;i=i+1) for(j=0;j<4;j=j+1) s=s+x[i][j]*2; return s;}'
+assert 7 'int main(){int a=3; int b=4; int c=7; int i=0; while(i<0) {c=a*b; i=i+1;} return c;}'
+assert 10 'int main(){int x[5]; int i; for(i=4;i>=0;i=i-1) x[i]=i; return x[1]+x[4]+x[2]+x[3];}'
+assert 15 'int main(){return f(5);} int f(int n){int x[10]; int i; int s=0; for(i=0;i<=n;i=i+1) x[i]=i; for(i=1;i<=n;i=i+1) s=s+x[i]; return s;}'
+assert 5 'int main(){int x[5]; int i; for(i=0;i<5;i=i+1) x[i]=1; return i;}'
+assert 66 'int main(){int a=0; int i=0; while(i<3) {a=a+(1+(2+(3+(4+(5+(6+i))))));i=i+1;} return a;}'
 
 assert 3 'int main(){return ret3();}'
 assert 5 'int main(){return ret5();}'
 
 assert 3 'int main(){return identity(3);}'
 assert 3 'int main(){return add2(1, 2);}'
+assert 43 'int main(){int a=ret3(); int b=ret5(); return a*10+b+add2(a,b);}'
+assert 13 'int main(){int a=ret3(); int b=ret5(); int x; if (a<b) x=a; else x=b; int y=0; if (a==3) y=10; return x+y;}'
+assert 8 'int main(){int a=ret5(); int b=ret3(); int x; if (a<=b) x=a-b; else x=b+a; if (a) x=x; else x=0; return x;}'
 
 assert 42 'int main() {return ret42();} int ret42() {return 42;}'
 
@@ -120,6 +154,19 @@ assert 8 'int main() {return isalnum(97);}'
 
 assert 6 'int main() {return add3(1,2,3);} int add3(int a, int b, int c) {return a+b+c;}'
 assert 55 'int main() {return fibo(9);} int fibo(int n) {if (n<=1) return 1; return fibo(n-2) + fibo(n-1);}'
+assert 42 'int ret42() {return 42;} int id(int x) {return x;} int main() {return id(ret42());}'
+assert 56 'int f(int a,int b,int c,int d,int e,int g,int h,int i){return a+b*2+c*3+d*4+e*5+g*6+h*7+i*8;} int main(){return f(1,1,1,1,1,1,1,2)-f(0,0,0,0,0,0,0,1)+f(8,7,6,5,4,3,2,1)-100;}'
+assert 49 'int f(int a,int b,int c,int d,int e,int g,int h,int i){if(a==0) return b+c+d+e+g+h+i; return f(a-1,b,c,d,e,g,h,i+a);} int main(){return f(6,1,1,1,1,1,1,1)+21;}'
+assert 9 'int max(int a, int b) {if (a<b) return b; return a;} int main() {return max(3,7)+max(2,1);}'
+assert 30 'int sum(int n) {int s=0; int i; for(i=1;i<=n;i=i+1) s=s+i; return s;} int main() {return sum(4)+sum(4)+sum(4);}'
+assert 14 'int f(int n){int x[100]; x[n]=n; return x[n]+1;} int main(){return f(1)+f(2)+f(3)+f(4);}'
+assert 57 'int g(int n){int y[4]; y[0]=n; y[1]=n*2; return y[0]+y[1];} int f(int n){int x[4]; x[0]=n; x[1]=g(n+1); x[2]=g(n+2); return x[0]+x[1]+x[2];} int main(){int s=0; int i; for(i=0;i<3;i=i+1) s=s+f(i)+g(i); return s;}'
+assert 72 'int f(int n){int x[2]; x[0]=n; x[1]=n+1; return x[0]*x[1];} int main(){return f(f(1)+f(2));}'
+assert 64 'int sum(int n, int acc) {if (n==0) return acc; return sum(n-1, acc+n);} int main() {return sum(1000000, 0) - 500000500000 + 64;}'
+assert 5 'int g(int *p){int a[10];int i;for(i=0;i<10;i=i+1)a[i]=99;return *p+a[3]-99;} int f(int n){int x=n;int y=0;return g(&x);} int main(){return f(5);}'
+assert 1 'int h(int n, int *p){int x=n; if(n==0) return *p; return h(n-1, &x);} int main(){int a=7; return h(3,&a);}'
+assert 2 'int f(int a, int b) {if (a==0) return b; return f(b-1, a);} int main() {return f(3, 5);}'
+assert 1 'int even(int n) {if (n==0) return 1; return odd(n-1);} int odd(int n) {if (n==0) return 0; return even(n-1);} int main() {return even(1000000);}'
 
 assert 3 'int main() {int x[3]; *x=3; *(x+1)=4; *(x+2)=5; return *(x);}'
 assert 4 'int main() {int x[3]; *x=3; *(x+1)=4; *(x+2)=5; return *(x+1);}'
@@ -132,6 +179,18 @@ assert 3 'int main() {int x[2]; x[0] = 3; x[1]=4; x[2]=5; return x[0];}'
 assert 4 'int main() {int x[2]; x[0] = 3; x[1]=4; x[2]=5; return x[1];}'
 assert 5 'int main() {int x[2]; x[0] = 3; x[1]=4; x[2]=5; return x[2];}'
 assert 5 'int main() {int x[2]; x[0] = 3; x[1]=4; 2[x]=5; return *(x+2);}'
+assert 234 'int main(){int x[4]; int *p=x; int i; int s=0; x[0]=1; x[1]=2; x[2]=3; x[3]=4; for(i=0;i<4;i=i+1) s=s*10+*(p+i); return s-1000;}'
+assert 6 'int main(){int x[4]; int i; x[0]=1; x[1]=2; x[2]=3; x[3]=4; i=1; return x[i+1]+x[3]+x[i-1]-x[i];}'
+assert 12 'int main(){int x[3]; int i; x[0]=0; x[1]=5; x[2]=7; i=0; if (x[1]==5) i=i+x[2]; if (x[2]<8) i=i+x[1]; return i;}'
+assert 7 'int main(){int i; i=0; if (ret3()==3) i=i+7; return i;}'
+assert 7 'int main(){int b=1000; int s=0; int i; for(i=0;i<3;i=i+1) s=s+ret3()-b+1000; return s-2;}'
+assert 53 'int main(){int s=0; int i; for(i=0;i<10;i=i+1) if (__builtin_expect(i==7, 0)) s=s+ret3()*5; else s=s+i; return s;}'
+assert 12 'int main(){int s=0; int i; int j; int n=0; for(i=0;i<n;i=i+1) s=s+100; for(i=0;i<3;i=i+1) for(j=0;j<i+1;j=j+1) s=s+2; for(;;) return s;}'
+assert 45 'int main(){int x[10]; int i; int s=0; for(i=0;i<10;i=i+1) x[i]=i; for(i=0;i<10;i=i+1) s=s+x[i]; return s;}'
+assert 35 'int main(){int x[10]; int i; int s=0; for(i=0;i<10;i=i+1) x[i]=i; for(i=9;i>4;i=i-1) s=s+x[i]; return s;}'
+assert 20 'int main(){int x[10]; int i; int s=0; for(i=0;i<10;i=i+1) x[i]=i; for(i=0;i!=10;i=i+2) s=s+x[i]; return s;}'
+assert 45 'int main(){int x[10]; int i; int s=0; for(i=0;i<10;i=i+1) x[i]=i; for(i=1;i<=9;i=i+1) s=s+x[i]; return s;}'
+assert 55 'int main(){int x[10]; int i; int s=0; for(i=0;i<10;i=i+1) x[i]=i; for(i=0;i<10;i=i+1) s=s+x[i]; return s+i;}'
 
 assert 0 'int main() {int x[2][3]; x[0][0]=0;x[0][1]=1;x[0][2]=2;x[1][0]=3;x[1][1]=4;x[1][2]=5; return x[0][0];}'
 assert 1 'int main() {int x[2][3]; x[0][0]=0;x[0][1]=1;x[0][2]=2;x[1][0]=3;x[1][1]=4;x[1][2]=5; return x[0][1];}'
@@ -140,4 +199,53 @@ assert 3 'int main() {int x[2][3]; x[0][0]=0;x[0][1]=1;x[0][2]=2;x[1][0]=3;x[1][
 assert 4 'int main() {int x[2][3]; x[0][0]=0;x[0][1]=1;x[0][2]=2;x[1][0]=3;x[1][1]=4;x[1][2]=5; return x[1][1];}'
 assert 5 'int main() {int x[2][3]; x[0][0]=0;x[0][1]=1;x[0][2]=2;x[1][0]=3;x[1][1]=4;x[1][2]=5; return x[1][2];}'
 
+# An input ending in .c is read from that file.
+printf 'int main() {\n    return 5;\n}\n' > tmp.c
+assert 5 tmp.c
+printf '%-4095s\n' 'int main(){return 6;}' > tmp.c
+assert 6 tmp.c
+printf 'int main() {\n    return 1 @ 2;\n}\n' > tmp.c
+if ! $BIN tmp.c 2>&1 >/dev/null | grep -q '^tmp.c:2:14: '; then
+    echo "tmp.c => want an error at tmp.c:2:14"
+    exit 1
+fi
+if ! $BIN --mem-stats -o tmp.s 'int main(){return 0;}' 2>&1 |
+    grep -q '^arena ir: [1-9][0-9]* objects'; then
+    echo "--mem-stats => want statistics for the ir arena"
+    exit 1
+fi
+if ! $BIN --stats -o tmp.s 'int main(){int x[10]; int i; int s=0; for(i=0;i<10;i=i+1) x[i]=i; for(i=0;i<10;i=i+1) s=s+x[i]; return s;}' 2>&1 |
+    grep -q '^main: spills 0 '; then
+    echo "two loops over x => want no spills"
+    exit 1
+fi
+dump=$($BIN --dump-ir1 --dump-ir-opt -o tmp.s 'int main(){int a=3; return a+4;}' 2>&1)
+if ! sed '/^dump ir opt$/q' <<<"$dump" | grep -q 'IR_ADD' ||
+    sed -n '/^dump ir opt$/,$p' <<<"$dump" | grep -q 'IR_ADD'; then
+    echo "--dump-ir1 --dump-ir-opt => want the IR before and after optimizing"
+    exit 1
+fi
+stats=$($BIN --stats -o tmp.s 'int main(){int a=1; int b=2; int c=3; int d=4; int e=5; int f=6; int g=7; int h=8; int i; int j=9; int k=10; int l=11; int m=12; for(i=0;i<10;i=i+1){int t=a; a=b; b=c; c=d; d=e; e=f; f=g; g=h; h=j; j=k; k=l; l=m; m=t;} return a+b*2+c*3+d+e+f+g+h+j+k+l+m*5;}' 2>&1)
+if ! grep -q '^peephole store-via-r10: [1-9]' <<<"$stats" ||
+    ! grep -q '^peephole load-via-r10: [1-9]' <<<"$stats"; then
+    echo "rotating 12 variables => want copies through %r10 folded"
+    exit 1
+fi
+frame=$($BIN --stats -o tmp.s 'int f(int n){int x[100]; x[n]=n; return x[n]+1;} int main(){return f(1)+f(2)+f(3)+f(4);}' 2>&1 |
+    sed -n 's/^main: spills [0-9]* frame //p')
+if (( frame >= 1600 )); then
+    echo "four inlined calls of f => want one copy of x in the frame, got frame $frame"
+    exit 1
+fi
+$BIN -o tmp.s 'int sum(int *x){int i; int s=0; for(i=0;i<10;i=i+1) s=s+x[i]; return s;} int main(){return 0;}'
+if grep -q 'add \$1,' tmp.s; then
+    echo "sum over x => want the loop counter gone"
+    exit 1
+fi
+if ! $BIN -o tests/nonexistent/tmp.s 'int main(){return 0;}' 2>&1 |
+    grep -q '^cannot open tests/nonexistent/tmp.s: '; then
+    echo "-o tests/nonexistent/tmp.s => want an error"
+    exit 1
+fi
+
 echo "ok"
@@ -0,0 +1,30 @@
+.globl sum
+sum:
+	push %rbx
+	push %r12
+	push %r13
+	push %r14
+	mov %rdi, %rbx
+	xor %r12, %r12
+	xor %r13, %r13
+	lea (%rbx,%r13,8), %r13
+	mov $10, %r14
+	lea (%rbx,%r14,8), %rbx
+	.p2align 4
+.Lbegin22:
+	add (%r13), %r12
+	add $8, %r13
+	cmp %rbx, %r13
+	jl .Lbegin22
+	mov %r12, %rax
+.L.return.sum:
+	pop %r14
+	pop %r13
+	pop %r12
+	pop %rbx
+	ret
+.globl main
+main:
+	xor %rax, %rax
+.L.return.main:
+	ret